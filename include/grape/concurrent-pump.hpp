@@ -3,12 +3,17 @@
 
 #include <atomic>
 #include <mutex>
+#include <memory>
+#include <thread>
+#include <set>
+#include <chrono>
 #include <condition_variable>
 
 #include <elliptics/session.hpp>
 #include <cocaine/framework/logging.hpp>
 
 #include <grape/data_array.hpp>
+#include <grape/delivery.hpp>
 #include <grape/entry_id.hpp>
 #include <grape/logger_adapter.hpp>
 
@@ -78,6 +83,147 @@ struct request {
 	}
 };
 
+// Keeps entries of batches leased while they are being processed:
+// every @interval_ms ack deadlines of every batch in flight are extended,
+// until processing of the batch is over (entries processed so far are
+// reported with processed() and are not extended anymore).
+// Reader has one keeper, its single thread serves all batches.
+class lease_keeper
+{
+public:
+	// Batch of entries in flight
+	struct lease {
+		ioremap::elliptics::exec_context context;
+		std::vector<entry_id> ids;
+		std::atomic_size_t done_count;
+		// time of the next extension
+		std::chrono::steady_clock::time_point next;
+
+		lease(const ioremap::elliptics::exec_context &context, const std::vector<entry_id> &ids)
+			: context(context)
+			, ids(ids)
+			, done_count(0)
+		{}
+	};
+
+private:
+	ioremap::elliptics::session client;
+	const std::string queue_name;
+	std::shared_ptr<cocaine::framework::logger_t> log;
+	const std::chrono::milliseconds interval;
+
+	std::set<std::shared_ptr<lease>> leases;
+	bool stop;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::thread thread;
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!stop) {
+			if (leases.empty()) {
+				condition.wait(lock);
+				continue;
+			}
+
+			auto now = std::chrono::steady_clock::now();
+			auto wakeup = now + interval;
+			for (const auto &l : leases) {
+				if (l->next <= now) {
+					extend(*l);
+					l->next = now + interval;
+				}
+				wakeup = std::min(wakeup, l->next);
+			}
+			condition.wait_until(lock, wakeup);
+		}
+	}
+
+	void extend(const lease &l) {
+		std::vector<entry_id> left(l.ids.begin() + std::min(l.done_count.load(), l.ids.size()), l.ids.end());
+		if (left.empty()) {
+			return;
+		}
+
+		std::string log_prefix = cocaine::format("%s %d", dnet_dump_id_str(l.context.src_id()->id), l.context.src_key());
+		auto log = this->log;
+		size_t count = left.size();
+
+		// ack wait timeout of the queue is counted anew from now
+		client.exec(l.context, queue_name + "@extend", serialize(std::make_pair(entry_range::from_ids(left), 0)))
+				.connect(ioremap::elliptics::async_result<ioremap::elliptics::exec_result_entry>::result_function(),
+					[log, log_prefix, count] (const ioremap::elliptics::error_info &error) {
+						if (error) {
+							COCAINE_LOG_ERROR(log, "%s: %ld entries not extended: %s", log_prefix.c_str(), count, error.message().c_str());
+						} else {
+							COCAINE_LOG_INFO(log, "%s: %ld entries extended", log_prefix.c_str(), count);
+						}
+					}
+				);
+	}
+
+public:
+	lease_keeper(ioremap::elliptics::session client, const std::string &queue_name,
+			std::shared_ptr<cocaine::framework::logger_t> log, int interval_ms)
+		: client(client)
+		, queue_name(queue_name)
+		, log(log)
+		, interval(interval_ms)
+		, stop(false)
+	{
+		this->client.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
+		thread = std::thread(&lease_keeper::run, this);
+	}
+
+	~lease_keeper() {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stop = true;
+		}
+		condition.notify_one();
+		thread.join();
+	}
+
+	// batch is extended from now on, until it is finished
+	std::shared_ptr<lease> start(const ioremap::elliptics::exec_context &context, const std::vector<entry_id> &ids) {
+		auto l = std::make_shared<lease>(context, ids);
+		l->next = std::chrono::steady_clock::now() + interval;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			leases.insert(l);
+		}
+		condition.notify_one();
+		return l;
+	}
+
+	void finish(const std::shared_ptr<lease> &l) {
+		std::unique_lock<std::mutex> lock(mutex);
+		leases.erase(l);
+	}
+};
+
+// Batch leased by the keeper while it is processed
+class leased_batch
+{
+private:
+	lease_keeper &keeper;
+	std::shared_ptr<lease_keeper::lease> lease;
+
+public:
+	leased_batch(lease_keeper &keeper, const ioremap::elliptics::exec_context &context, const std::vector<entry_id> &ids)
+		: keeper(keeper)
+		, lease(keeper.start(context, ids))
+	{}
+
+	~leased_batch() {
+		keeper.finish(lease);
+	}
+
+	void processed(size_t count) {
+		lease->done_count = count;
+	}
+};
+
 template<class queue_reader_impl>
 class base_queue_reader
 {
@@ -93,6 +239,14 @@ protected:
 
 	int concurrency_limit;
 
+	// long poll time of a peek request, 0 for plain peeks
+	int wait_ms;
+	// entries per streamed reply fragment, 0 for a single reply
+	int fragment_entries;
+
+	// extends ack deadlines of batches while they are processed, none if not set
+	std::unique_ptr<lease_keeper> leases;
+
 public:
 	base_queue_reader(ioremap::elliptics::session client, const std::string &queue_name, int request_size, int concurrency_limit)
 		: client(client)
@@ -100,11 +254,33 @@ public:
 		, request_size(request_size)
 		, next_request_id(0)
 		, concurrency_limit(concurrency_limit)
+		, wait_ms(0)
+		, fragment_entries(0)
 	{
 		srand(time(NULL));
 		log = std::make_shared<logger_adapter>(client.get_node().get_log());
 	}
 
+	// Makes queue hold peek requests for up to @ms milliseconds
+	// until entries are pushed, instead of replying empty at once
+	// (session's timeout must be longer than that)
+	void set_wait_time(int ms) {
+		wait_ms = ms;
+	}
+
+	// Makes queue stream its reply in fragments of @entries entries,
+	// every fragment is processed as soon as it arrives
+	void set_fragment_size(int entries) {
+		fragment_entries = entries;
+	}
+
+	// Makes reader extend ack deadlines of entries every @ms milliseconds
+	// while they are being processed, so that processing could take longer
+	// than queue's ack wait timeout (@ms must be less than that)
+	void set_auto_extend(int ms) {
+		leases.reset(ms > 0 ? new lease_keeper(client, queue_name, log, ms) : nullptr);
+	}
+
 	void run() {
 		runloop.concurrency_limit = concurrency_limit;
 		runloop.run([this] () {
@@ -156,8 +332,9 @@ public:
 	{
 		client.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
 
+		// consumers mostly ack contiguous runs of entries, they go as ranges
 		size_t count = ids.size();
-		client.exec(context, queue_name + "@ack-multi", serialize(ids))
+		client.exec(context, queue_name + "@ack-range", serialize(entry_range::from_ids(ids)))
 				.connect(ioremap::elliptics::async_result<ioremap::elliptics::exec_result_entry>::result_function(),
 					[log, log_prefix, count] (const ioremap::elliptics::error_info &error) {
 						if (error) {
@@ -178,7 +355,12 @@ public:
 		auto req = std::make_shared<request>(req_unique_id);
 		client.transform(queue_key, req->id);
 
-		client.exec(&req->id, req->src_key, queue_name + "@peek-multi", std::to_string(arg))
+		std::string peek_arg = std::to_string(arg);
+		if (wait_ms > 0 || fragment_entries > 0) {
+			peek_arg = cocaine::format("{\"num\": %d, \"wait-ms\": %d, \"fragment-entries\": %d}", arg, wait_ms, fragment_entries);
+		}
+
+		client.exec(&req->id, req->src_key, queue_name + "@peek-multi", peek_arg)
 				.connect(
 					std::bind(&base_queue_reader::data_received, this, req, std::placeholders::_1),
 					std::bind(&base_queue_reader::request_complete, this, req, std::placeholders::_1)
@@ -194,7 +376,9 @@ public:
 
 		ioremap::elliptics::exec_context context = result.context();
 
-		// queue.peek returns no data when queue is empty.
+		// queue.peek returns no data when queue is empty
+		// (and streamed reply ends with an empty final fragment).
+		// Every fragment of a streamed reply is a self-contained data_array.
 		if (context.data().empty()) {
 			return;
 		}
@@ -263,6 +447,11 @@ public:
 
 		std::vector<entry_id> ack_ids;
 
+		std::unique_ptr<leased_batch> lease;
+		if (leases) {
+			lease.reset(new leased_batch(*leases, context, array.ids()));
+		}
+
 		size_t offset = 0;
 		for (size_t i = 0; i < count; ++i) {
 			const entry_id &id = array.ids()[i];
@@ -274,7 +463,11 @@ public:
 			}
 
 			offset += bytesize;
+			if (lease) {
+				lease->processed(i + 1);
+			}
 		}
+		lease.reset();
 
 		// acknowledge entries
 		COCAINE_LOG_INFO(log, "%s %d: acking %ld entries",
@@ -315,7 +508,14 @@ public:
 	}
 
 	void process_data_array(std::shared_ptr<request> req, ioremap::elliptics::exec_context context, data_array &array) {
-		int proc_result = proc(context, array);
+		int proc_result;
+		{
+			std::unique_ptr<leased_batch> lease;
+			if (leases) {
+				lease.reset(new leased_batch(*leases, context, array.ids()));
+			}
+			proc_result = proc(context, array);
+		}
 		handle_process_result(proc_result, req, context, array);
 	}
 };
@@ -326,6 +526,10 @@ public:
 	typedef ioremap::elliptics::data_pointer generator_result_type;
 	typedef std::function<generator_result_type ()> generation_function;
 
+	// batch generator: every generated array is sent with a single push-multi request
+	typedef data_array batch_generator_result_type;
+	typedef std::function<batch_generator_result_type ()> batch_generation_function;
+
 private:
 	concurrent_pump runloop;
 
@@ -335,8 +539,15 @@ private:
 	std::shared_ptr<cocaine::framework::logger_t> log;
 
 	int concurrency_limit;
+	// priority lane entries are pushed to, 0 is the highest
+	int priority;
+	// entries become visible to readers in that many milliseconds
+	int64_t delay;
+	// entries expire in that many seconds, 0 is the queue's ttl
+	int ttl;
 
 	generation_function gen;
+	batch_generation_function batch_gen;
 
 public:
 	queue_writer(ioremap::elliptics::session client, const std::string &queue_name, int concurrency_limit = 1)
@@ -344,11 +555,26 @@ public:
 		, queue_name(queue_name)
 		, next_request_id(0)
 		, concurrency_limit(concurrency_limit)
+		, priority(0)
+		, delay(0)
+		, ttl(0)
 	{
 		log = std::make_shared<logger_adapter>(client.get_node().get_log());
 		srand(time(NULL));
 	}
 
+	void set_priority(int value) {
+		priority = value;
+	}
+
+	void set_delay(int64_t ms) {
+		delay = ms;
+	}
+
+	void set_ttl(int seconds) {
+		ttl = seconds;
+	}
+
 	void run(generation_function func) {
 		gen = func;
 		runloop.concurrency_limit = concurrency_limit;
@@ -361,7 +587,46 @@ public:
 		});
 	}
 
+	void run_multi(batch_generation_function func) {
+		batch_gen = func;
+		runloop.concurrency_limit = concurrency_limit;
+		runloop.run([this] () {
+			batch_generator_result_type d = batch_gen();
+			if (d.empty()) {
+				runloop.stop();
+			}
+			queue_push_multi(client, next_request_id++, d);
+		});
+	}
+
 	void queue_push(ioremap::elliptics::session client, int req_unique_id, ioremap::elliptics::data_pointer d)
+	{
+		if ((priority || delay || ttl) && !d.empty()) {
+			data_array array;
+			array.append((const char *)d.data(), d.size(), entry_id());
+			queue_push_multi(client, req_unique_id, array);
+			return;
+		}
+		queue_exec(client, req_unique_id, "@push", d);
+	}
+
+	void queue_push_multi(ioremap::elliptics::session client, int req_unique_id, const data_array &d)
+	{
+		// queue treats empty push-multi as a no-op, same as an empty push
+		// ttl goes only with delivery options of the delayed push
+		if ((delay || ttl) && !d.empty()) {
+			queue_exec(client, req_unique_id, "@push-delayed", serialize(std::make_pair(delivery{delay, 0, priority, ttl}, d)));
+			return;
+		}
+		if (priority && !d.empty()) {
+			queue_exec(client, req_unique_id, "@push-priority", serialize(std::make_pair(priority, d)));
+			return;
+		}
+		queue_exec(client, req_unique_id, "@push-multi",
+				d.empty() ? ioremap::elliptics::data_pointer() : serialize(d));
+	}
+
+	void queue_exec(ioremap::elliptics::session client, int req_unique_id, const std::string &event, ioremap::elliptics::data_pointer d)
 	{
 		client.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
 
@@ -370,7 +635,7 @@ public:
 		auto req = std::make_shared<request>(req_unique_id);
 		client.transform(queue_key, req->id);
 
-		client.exec(&req->id, req->src_key, queue_name + "@push", d)
+		client.exec(&req->id, req->src_key, queue_name + event, d)
 			.connect(
 				ioremap::elliptics::async_result<ioremap::elliptics::exec_result_entry>::result_function(),
 				std::bind(&queue_writer::request_complete, this, req, std::placeholders::_1)
@@ -18,6 +18,8 @@ private:
 	std::vector<entry_id> m_id;
 	std::vector<int> m_size;
 	std::string m_data;
+	// delivery attempts of entries, empty if all entries are delivered for the first time
+	std::vector<int> m_attempts;
 
 public:
 	// virtual view into single array item
@@ -26,6 +28,7 @@ public:
 		const char *data;
 		size_t size;
 		grape::entry_id entry_id;
+		int attempts;
 	};
 
 	class iterator : public std::iterator<std::forward_iterator_tag, entry>
@@ -58,6 +61,7 @@ public:
 	};
 
 	void append(const char *data, size_t size, const entry_id &id);
+	void append(const char *data, size_t size, const entry_id &id, int attempts);
 	void append(const std::string &data, const entry_id &id);
 	void append(const data_array::entry &entry);
 	void extend(const data_array &d);
@@ -68,13 +72,16 @@ public:
 	const std::vector<entry_id> &ids() const;
 	const std::vector<int> &sizes() const;
 	const std::string &data() const;
+	// number of times entry at @index has been given out (including this one)
+	int attempts(size_t index) const;
 
 	// iteration interface
 
 	iterator begin() const;
 	iterator end() const;
 
-	MSGPACK_DEFINE(m_id, m_size, m_data);
+	// attempts go last, so arrays are readable by older code and vice versa
+	MSGPACK_DEFINE(m_id, m_size, m_data, m_attempts);
 };
 
 template <class T>
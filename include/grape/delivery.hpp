@@ -0,0 +1,25 @@
+#ifndef __DELIVERY_HPP
+#define __DELIVERY_HPP
+
+#include <stdint.h>
+
+#include <msgpack.hpp>
+
+namespace ioremap { namespace grape {
+
+// Options of the delayed push (sent along with entries in queue's push-delayed event):
+// entries become visible to peek at @deliver_at (milliseconds since epoch)
+// or, if it is 0, in @delay milliseconds from now;
+// entries expire @ttl seconds after delivery (0 is the queue's ttl)
+struct delivery {
+	int64_t delay;
+	int64_t deliver_at;
+	int priority;
+	int ttl;
+
+	MSGPACK_DEFINE(delay, deliver_at, priority, ttl);
+};
+
+}} // namespace ioremap::grape
+
+#endif /* __DELIVERY_HPP */
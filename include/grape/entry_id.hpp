@@ -1,6 +1,8 @@
 #ifndef __ENTRY_ID_HPP
 #define __ENTRY_ID_HPP
 
+#include <vector>
+
 #include <msgpack.hpp>
 #include <elliptics/packet.h>
 
@@ -19,6 +21,28 @@ struct entry_id {
     MSGPACK_DEFINE(chunk, pos);
 };
 
+// Run of entries of the same chunk, from @from to @to (inclusive)
+struct entry_range {
+    int32_t chunk;
+    int32_t from;
+    int32_t to;
+
+    // Packs ids into ranges, contiguous runs of ids become single ranges
+    static std::vector<entry_range> from_ids(const std::vector<entry_id> &ids) {
+        std::vector<entry_range> ranges;
+        for (const auto &id : ids) {
+            if (!ranges.empty() && ranges.back().chunk == id.chunk && ranges.back().to + 1 == id.pos) {
+                ranges.back().to = id.pos;
+            } else {
+                ranges.push_back(entry_range{id.chunk, id.pos, id.pos});
+            }
+        }
+        return ranges;
+    }
+
+    MSGPACK_DEFINE(chunk, from, to);
+};
+
 }}
 
 #endif // __ENTRY_ID_HPP
@@ -1,17 +1,35 @@
+#include <algorithm>
+
 #include "grape/data_array.hpp"
 
 namespace ioremap { namespace grape {
 
 void data_array::append(const char *data, size_t size, const entry_id &id)
+{
+	append(data, size, id, 1);
+}
+
+void data_array::append(const char *data, size_t size, const entry_id &id, int attempts)
 {
 	size_t old_data_size = m_data.size();
+	size_t old_sizes_size = m_size.size();
+	size_t old_ids_size = m_id.size();
 
 	try {
 		m_data.insert(m_data.end(), data, data + size);
 		m_size.push_back(size);
 		m_id.push_back(id);
+		if (attempts != 1 && m_attempts.empty()) {
+			m_attempts.resize(old_sizes_size, 1);
+		}
+		if (!m_attempts.empty()) {
+			m_attempts.push_back(attempts);
+		}
 	} catch (...) {
 		m_data.resize(old_data_size);
+		m_size.resize(old_sizes_size);
+		m_id.resize(old_ids_size);
+		m_attempts.resize(std::min(m_attempts.size(), old_sizes_size));
 		throw;
 	}
 }
@@ -23,7 +41,7 @@ void data_array::append(const std::string &data, const entry_id &id)
 
 void data_array::append(const data_array::entry &entry)
 {
-	append(entry.data, entry.size, entry.entry_id);
+	append(entry.data, entry.size, entry.entry_id, entry.attempts);
 }
 
 void data_array::extend(const data_array &d)
@@ -36,10 +54,19 @@ void data_array::extend(const data_array &d)
 		m_data.insert(m_data.end(), d.data().begin(), d.data().end());
 		m_size.insert(m_size.end(), d.sizes().begin(), d.sizes().end());
 		m_id.insert(m_id.end(), d.ids().begin(), d.ids().end());
+		if (!m_attempts.empty() || !d.m_attempts.empty()) {
+			m_attempts.resize(old_sizes_size, 1);
+			if (d.m_attempts.empty()) {
+				m_attempts.resize(m_size.size(), 1);
+			} else {
+				m_attempts.insert(m_attempts.end(), d.m_attempts.begin(), d.m_attempts.end());
+			}
+		}
 	} catch (...) {
 		m_data.resize(old_data_size);
 		m_size.resize(old_sizes_size);
 		m_id.resize(old_ids_size);
+		m_attempts.resize(std::min(m_attempts.size(), old_sizes_size));
 		throw;
 	}
 }
@@ -59,6 +86,11 @@ const std::string &data_array::data(void) const
 	return m_data;
 }
 
+int data_array::attempts(size_t index) const
+{
+	return m_attempts.empty() ? 1 : m_attempts[index];
+}
+
 bool data_array::empty(void) const
 {
 	return m_size.empty();
@@ -101,6 +133,7 @@ void data_array::iterator::prepare_value() const
 	value.data = (const char *)array->data().data() + offset;
 	value.size = array->sizes()[index];
 	value.entry_id = array->ids()[index];
+	value.attempts = array->attempts(index);
 }
 
 data_array::iterator::value_type data_array::iterator::operator *() const
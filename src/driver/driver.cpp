@@ -79,6 +79,7 @@ queue_driver::queue_driver(cocaine::context_t& context, cocaine::io::reactor_t &
 	, m_wait_timeout(args.get("wait-timeout", 60).asInt())
 	, m_check_timeout(args.get("check-timeout", 30).asInt())
 	, m_request_size(args.get("request-size", 100).asInt())
+	, m_request_wait_ms(args.get("request-wait-ms", 0).asInt())
 	, m_rate_upper_limit(args.get("rate-upper-limit", 0.0f).asDouble())
 	, m_initial_rate_boost(args.get("initial-rate-boost", 0.0f).asDouble())
 	, m_queue_name(args.get("source-queue-app", "queue").asString())
@@ -311,8 +312,13 @@ void queue_driver::send_request()
 
 	sess.set_groups(m_queue_groups);
 
+	std::string request_arg = std::to_string(req->num);
+	if (m_request_wait_ms > 0) {
+		request_arg = cocaine::format("{\"num\": %d, \"wait-ms\": %d}", req->num, m_request_wait_ms);
+	}
+
 	sess.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
-	sess.exec(&req->id, req->src_key, m_queue_pop_event, std::to_string(req->num)).connect(
+	sess.exec(&req->id, req->src_key, m_queue_pop_event, request_arg).connect(
 		std::bind(&queue_driver::on_queue_request_data, this, req, std::placeholders::_1),
 		std::bind(&queue_driver::on_queue_request_complete, this, req, std::placeholders::_1)
 	);
@@ -84,6 +84,8 @@ class queue_driver: public api::driver_t {
 		int m_wait_timeout;
 		int m_check_timeout;
 		int m_request_size;
+		// queue holds empty requests for that long waiting for entries (long poll)
+		int m_request_wait_ms;
 		double m_rate_upper_limit;
 		double m_initial_rate_boost;
 
@@ -29,6 +29,9 @@ int main(int argc, char** argv)
 	elliptics.add_options()
 		("concurrency,n", value<int>()->default_value(1), "concurrency limit")
 		("limit,l", value<int>()->default_value(0), "upper limit")
+		("priority,p", value<int>()->default_value(0), "priority lane to push to")
+		("delay,d", value<int>()->default_value(0), "milliseconds to delay delivery of entries by")
+		("ttl,t", value<int>()->default_value(0), "seconds entries expire in (0 is the queue's ttl)")
 		;
 
 	options_description opts;
@@ -68,6 +71,9 @@ int main(int argc, char** argv)
 
 	int concurrency = args["concurrency"].as<int>();
 	int limit = args["limit"].as<int>();
+	int priority = args["priority"].as<int>();
+	int delay = args["delay"].as<int>();
+	int ttl = args["ttl"].as<int>();
 
 	auto clientlib = elliptics_client_state::create(
 			remotes, groups, logfile, loglevel,
@@ -78,6 +84,9 @@ int main(int argc, char** argv)
 
 	// write queue indefinitely, with ever increasing number
 	queue_writer pump(clientlib.create_session(), queue_name, concurrency);
+	pump.set_priority(priority);
+	pump.set_delay(delay);
+	pump.set_ttl(ttl);
 	int counter = 0;
 	pump.run([&counter, &limit] () {
 		if (limit > 0 && counter >= limit) {
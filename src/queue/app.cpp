@@ -1,9 +1,13 @@
 #include <fstream>
+#include <limits>
+#include <stdexcept>
 
 #include <cocaine/format.hpp>
 #include <cocaine/framework/logging.hpp>
 #include <cocaine/framework/dispatch.hpp>
 
+#include <grape/delivery.hpp>
+
 #include "queue.hpp"
 
 namespace {
@@ -26,6 +30,55 @@ double exponential_moving_average(double avg, double input, double alpha) {
 	//return avg + alpha * (input - avg);
 }
 
+struct peek_args {
+	int num;
+	uint64_t max_bytes;
+	// long poll
+	uint64_t wait_ms;
+	int min_entries;
+	// reply is streamed in fragments of that many entries (0 is a single reply)
+	int fragment_entries;
+};
+
+// Peek-multi (and pop-multi) argument is either an entry count in a decimal string form (legacy)
+// or JSON object {"num": <entry count>, "max-bytes": <byte budget of the reply>,
+// "wait-ms": <time to wait for entries>, "min-entries": <batch worth replying>,
+// "fragment-entries": <entries per streamed reply>}, all fields are optional there
+peek_args parse_peek_args(const std::string &arg)
+{
+	peek_args args = {0, 0, 0, 0, 0};
+
+	if (arg.empty() || arg[0] != '{') {
+		args.num = stoi(arg);
+		return args;
+	}
+
+	rapidjson::Document doc;
+	doc.Parse<0>(arg.c_str());
+	if (doc.HasParseError() || !doc.IsObject()) {
+		throw std::invalid_argument("bad peek argument: " + arg);
+	}
+
+	args.num = std::numeric_limits<int>::max();
+	if (doc.HasMember("num")) {
+		args.num = doc["num"].GetInt();
+	}
+	if (doc.HasMember("max-bytes")) {
+		args.max_bytes = doc["max-bytes"].GetUint64();
+	}
+	if (doc.HasMember("wait-ms")) {
+		args.wait_ms = doc["wait-ms"].GetUint64();
+	}
+	if (doc.HasMember("min-entries")) {
+		args.min_entries = doc["min-entries"].GetInt();
+	}
+	if (doc.HasMember("fragment-entries")) {
+		args.fragment_entries = doc["fragment-entries"].GetInt();
+	}
+
+	return args;
+}
+
 struct rate_stat
 {
 	uint64_t last_update; // in microseconds
@@ -57,7 +110,11 @@ struct time_stat
 		start_time = microseconds_now();
 	}
 	void stop() {
-		avg = modified_moving_average<19>(avg, microseconds_now() - start_time);
+		add(microseconds_now() - start_time);
+	}
+	// for requests overlapping in time, each one keeps its own start time
+	void add(uint64_t elapsed) {
+		avg = modified_moving_average<19>(avg, elapsed);
 	}
 
 	double get() {
@@ -75,8 +132,27 @@ class queue_app_context {
 		void process(const std::string &cocaine_event, const std::vector<std::string> &chunks, cocaine::framework::response_ptr response);
 
 	private:
+		// replies to the producer once pushed entries are written
+		ioremap::grape::queue::push_handler push_reply(cocaine::framework::response_ptr response, const ioremap::elliptics::exec_context &context);
+
 		typedef ioremap::grape::data_array peek_multi_type;
+
+		// Replies with entries serialized as a whole or, with @fragment_entries,
+		// as a stream of self-contained sub-arrays followed by an empty final reply
+		void reply_entries(cocaine::framework::response_ptr response, const ioremap::elliptics::exec_context &context,
+				const peek_multi_type &d, int fragment_entries);
+
+		typedef ioremap::grape::data_array push_multi_type;
+		// priority (lane, 0 is the highest) and entries to push
+		typedef std::pair<int, ioremap::grape::data_array> push_priority_type;
+		// delivery time (and priority) and entries to push
+		typedef std::pair<ioremap::grape::delivery, ioremap::grape::data_array> push_delayed_type;
 		typedef std::vector<ioremap::grape::entry_id> ack_multi_type;
+		typedef std::vector<ioremap::grape::entry_range> ack_range_type;
+		// entry ids and delay of their redelivery in milliseconds
+		typedef std::pair<std::vector<ioremap::grape::entry_id>, int> nack_multi_type;
+		// entry ranges and time to extend their ack deadlines to, in milliseconds (0 is ack wait timeout)
+		typedef std::pair<std::vector<ioremap::grape::entry_range>, int> extend_type;
 
 		std::string m_id;
 		std::shared_ptr<cocaine::framework::logger_t> m_log;
@@ -106,6 +182,9 @@ queue_app_context::queue_app_context(cocaine::framework::dispatch_t& dispatch)
 	// register event handlers
 	dispatch.on("ping", this, &queue_app_context::process);
 	dispatch.on("push", this, &queue_app_context::process);
+	dispatch.on("push-multi", this, &queue_app_context::process);
+	dispatch.on("push-priority", this, &queue_app_context::process);
+	dispatch.on("push-delayed", this, &queue_app_context::process);
 	dispatch.on("pop-multi", this, &queue_app_context::process);
 	dispatch.on("pop-multiple-string", this, &queue_app_context::process);
 	dispatch.on("pop", this, &queue_app_context::process);
@@ -113,6 +192,11 @@ queue_app_context::queue_app_context(cocaine::framework::dispatch_t& dispatch)
 	dispatch.on("peek-multi", this, &queue_app_context::process);
 	dispatch.on("ack", this, &queue_app_context::process);
 	dispatch.on("ack-multi", this, &queue_app_context::process);
+	dispatch.on("ack-range", this, &queue_app_context::process);
+	dispatch.on("ack-upto", this, &queue_app_context::process);
+	dispatch.on("extend", this, &queue_app_context::process);
+	dispatch.on("nack", this, &queue_app_context::process);
+	dispatch.on("nack-multi", this, &queue_app_context::process);
 	dispatch.on("clear", this, &queue_app_context::process);
 	dispatch.on("stats-clear", this, &queue_app_context::process);
 	dispatch.on("stats", this, &queue_app_context::process);
@@ -122,6 +206,52 @@ queue_app_context::~queue_app_context()
 {
 }
 
+ioremap::grape::queue::push_handler queue_app_context::push_reply(cocaine::framework::response_ptr response, const ioremap::elliptics::exec_context &context)
+{
+	// queue keeps the handler (in its push backlog, groups and chunk writes),
+	// so it must not own the queue: app context outlives the queue anyway
+	ioremap::grape::queue *queue = m_queue.get();
+	return [queue, response, context] (const ioremap::elliptics::error_info &error) {
+		if (error) {
+			response->error(-error.code(), error.message());
+		} else {
+			queue->final(response, context, ioremap::elliptics::data_pointer());
+		}
+	};
+}
+
+void queue_app_context::reply_entries(cocaine::framework::response_ptr response, const ioremap::elliptics::exec_context &context,
+		const peek_multi_type &d, int fragment_entries)
+{
+	if (d.empty()) {
+		m_queue->final(response, context, ioremap::elliptics::data_pointer());
+		return;
+	}
+
+	if (fragment_entries <= 0 || (int)d.sizes().size() <= fragment_entries) {
+		m_queue->final(response, context, ioremap::grape::serialize(d));
+		return;
+	}
+
+	// every fragment is sent as soon as it is serialized,
+	// so consumer could start on it while the rest is on its way
+	peek_multi_type fragment;
+	int count = 0;
+	for (const auto &entry : d) {
+		fragment.append(entry);
+		if (++count == fragment_entries) {
+			m_queue->reply(response, context, ioremap::grape::serialize(fragment), ioremap::elliptics::exec_context::progressive);
+			fragment = peek_multi_type();
+			count = 0;
+		}
+	}
+	if (!fragment.empty()) {
+		m_queue->reply(response, context, ioremap::grape::serialize(fragment), ioremap::elliptics::exec_context::progressive);
+	}
+
+	m_queue->final(response, context, ioremap::elliptics::data_pointer());
+}
+
 void queue_app_context::process(const std::string &cocaine_event, const std::vector<std::string> &chunks, cocaine::framework::response_ptr response)
 {
 	ioremap::elliptics::exec_context context = ioremap::elliptics::exec_context::from_raw(chunks[0].c_str(), chunks[0].size());
@@ -135,6 +265,8 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 			event.c_str(), context.data().size()
 			);
 
+	auto guard = m_queue->lock();
+
 	if (event == "ping") {
 		m_queue->final(response, context, "ok");
 
@@ -145,86 +277,173 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 		// to indicate queue emptiness
 		if (!d.empty()) {
 			m_push_time.start();
-			m_queue->push(d);
+			// reply is postponed until the entry is durably written
+			m_queue->push(d, push_reply(response, context));
 			m_push_time.stop();
 			COCAINE_LOG_INFO(m_log, "%s, push time %ld",
 					action_id.c_str(),
 					microseconds_now() - m_push_time.start_time
 					);
 			m_push_rate.update(1);
+		} else {
+			m_queue->final(response, context, ioremap::elliptics::data_pointer());
 		}
-		m_queue->final(response, context, ioremap::elliptics::data_pointer());
 
-	} else if (event == "pop-multi") {
-		int num = stoi(context.data().to_string());
+	} else if (event == "push-multi") {
+		size_t count = 0;
+		// same as with single push, empty request is just a no-op
+		if (!context.data().empty()) {
+			auto d = ioremap::grape::deserialize<push_multi_type>(context.data());
+			count = d.sizes().size();
 
-		m_pop_time.start();
-		m_ack_time.start();
-		peek_multi_type d = m_queue->pop(num);
-		m_ack_time.stop();
-		m_pop_time.stop();
-		if (!d.empty()) {
-			m_queue->final(response, context, ioremap::grape::serialize(d));
-			m_pop_rate.update(d.sizes().size());
-			m_ack_rate.update(d.sizes().size());
+			m_push_time.start();
+			m_queue->push(d, push_reply(response, context));
+			m_push_time.stop();
+			m_push_rate.update(count);
 		} else {
 			m_queue->final(response, context, ioremap::elliptics::data_pointer());
 		}
 
-		COCAINE_LOG_INFO(m_log, "%s, completed event: %s, size: %ld, popped: %d/%d (multiple: '%s')",
+		COCAINE_LOG_INFO(m_log, "%s, pushed %ld entries",
 				action_id.c_str(),
-				event.c_str(), context.data().size(),
-				d.sizes().size(), num, context.data().to_string().c_str()
+				count
 				);
 
-	} else if (event == "pop") {
-		m_pop_time.start();
-		m_ack_time.start();
-		m_queue->final(response, context, m_queue->pop());
-		m_ack_time.stop();
-		m_pop_time.stop();
-		m_pop_rate.update(1);
-		m_ack_rate.update(1);
+	} else if (event == "push-priority") {
+		push_priority_type d(0, ioremap::grape::data_array());
+		if (!context.data().empty()) {
+			d = ioremap::grape::deserialize<push_priority_type>(context.data());
+		}
+		size_t count = d.second.sizes().size();
 
-	} else if (event == "peek") {
-		m_pop_time.start();
-		ioremap::grape::entry_id entry_id;
-		ioremap::elliptics::data_pointer d = m_queue->peek(&entry_id);
+		// as with push-multi, nothing to push is a no-op
+		if (count) {
+			m_push_time.start();
+			m_queue->push(d.second, push_reply(response, context), d.first);
+			m_push_time.stop();
+			m_push_rate.update(count);
+		} else {
+			m_queue->final(response, context, ioremap::elliptics::data_pointer());
+		}
 
-		COCAINE_LOG_INFO(m_log, "%s, peeked entry: %d-%d: (%ld)'%s'",
+		COCAINE_LOG_INFO(m_log, "%s, pushed %ld entries, priority %d",
 				action_id.c_str(),
-				entry_id.chunk, entry_id.pos, d.size(), d.to_string()
+				count, d.first
 				);
 
-		// embed entry id directly into sph of the reply
-		dnet_raw_id *src = context.src_id();
-		memcpy(&src->id[DNET_ID_SIZE - sizeof(entry_id)], &entry_id, sizeof(entry_id));
-
-		m_queue->final(response, context, d);
-
-		m_pop_time.stop();
-		m_pop_rate.update(1);
-
-	} else if (event == "peek-multi") {
-		m_pop_time.start();
-		int num = stoi(context.data().to_string());
+	} else if (event == "push-delayed") {
+		push_delayed_type d(ioremap::grape::delivery{0, 0, 0, 0}, ioremap::grape::data_array());
+		if (!context.data().empty()) {
+			d = ioremap::grape::deserialize<push_delayed_type>(context.data());
+		}
+		size_t count = d.second.sizes().size();
 
-		peek_multi_type d = m_queue->peek(num);
+		int64_t deliver_at = d.first.deliver_at;
+		if (!deliver_at) {
+			timespec t;
+			clock_gettime(CLOCK_REALTIME, &t);
+			deliver_at = (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000 + d.first.delay;
+		}
 
-		if (!d.empty()) {
-			m_queue->final(response, context, ioremap::grape::serialize(d));
-			m_pop_rate.update(d.sizes().size());
+		if (count) {
+			m_push_time.start();
+			m_queue->push_delayed(d.second, deliver_at, push_reply(response, context), d.first.priority, d.first.ttl);
+			m_push_time.stop();
+			m_push_rate.update(count);
 		} else {
 			m_queue->final(response, context, ioremap::elliptics::data_pointer());
 		}
 
-		m_pop_time.stop();
-
-		COCAINE_LOG_INFO(m_log, "%s, peeked %ld entries (asked %d)",
+		COCAINE_LOG_INFO(m_log, "%s, pushed %ld entries, delivery at %lld ms",
 				action_id.c_str(),
-				d.sizes().size(), num
+				count, (long long)deliver_at
 				);
 
+	} else if (event == "pop-multi") {
+		peek_args args = parse_peek_args(context.data().to_string());
+		int num = args.num;
+		uint64_t start_time = microseconds_now();
+
+		// reply is postponed until entries are read from the storage (or pushed, with wait-ms)
+		m_queue->pop(num, args.max_bytes, args.wait_ms * 1000, args.min_entries,
+				[this, response, context, action_id, event, num, args, start_time] (const peek_multi_type &d) {
+			uint64_t elapsed = microseconds_now() - start_time;
+			m_pop_time.add(elapsed);
+			m_ack_time.add(elapsed);
+			reply_entries(response, context, d, args.fragment_entries);
+			if (!d.empty()) {
+				m_pop_rate.update(d.sizes().size());
+				m_ack_rate.update(d.sizes().size());
+			}
+
+			COCAINE_LOG_INFO(m_log, "%s, completed event: %s, size: %ld, popped: %d/%d (multiple: '%s')",
+					action_id.c_str(),
+					event.c_str(), context.data().size(),
+					d.sizes().size(), num, context.data().to_string().c_str()
+					);
+		});
+
+	} else if (event == "pop") {
+		uint64_t start_time = microseconds_now();
+
+		m_queue->pop(1, 0, 0, 0, [this, response, context, start_time] (const peek_multi_type &d) {
+			uint64_t elapsed = microseconds_now() - start_time;
+			m_pop_time.add(elapsed);
+			m_ack_time.add(elapsed);
+
+			m_queue->final(response, context, ioremap::elliptics::data_pointer::copy(d.data().data(), d.data().size()));
+
+			m_pop_rate.update(1);
+			m_ack_rate.update(1);
+		});
+
+	} else if (event == "peek") {
+		uint64_t start_time = microseconds_now();
+
+		m_queue->peek(1, 0, 0, 0, [this, response, context, action_id, start_time] (const peek_multi_type &d) mutable {
+			ioremap::grape::entry_id entry_id = {-1, -1};
+			if (!d.empty()) {
+				entry_id = d.ids()[0];
+			}
+			ioremap::elliptics::data_pointer data = ioremap::elliptics::data_pointer::copy(d.data().data(), d.data().size());
+
+			COCAINE_LOG_INFO(m_log, "%s, peeked entry: %d-%d: (%ld)'%s'",
+					action_id.c_str(),
+					entry_id.chunk, entry_id.pos, data.size(), data.to_string()
+					);
+
+			// embed entry id directly into sph of the reply
+			dnet_raw_id *src = context.src_id();
+			memcpy(&src->id[DNET_ID_SIZE - sizeof(entry_id)], &entry_id, sizeof(entry_id));
+
+			m_queue->final(response, context, data);
+
+			m_pop_time.add(microseconds_now() - start_time);
+			m_pop_rate.update(1);
+		});
+
+	} else if (event == "peek-multi") {
+		uint64_t start_time = microseconds_now();
+		peek_args args = parse_peek_args(context.data().to_string());
+		int num = args.num;
+		uint64_t max_bytes = args.max_bytes;
+
+		// with wait-ms reply is postponed until entries are pushed (or the time passes)
+		m_queue->peek(num, max_bytes, args.wait_ms * 1000, args.min_entries,
+				[this, response, context, action_id, num, max_bytes, args, start_time] (const peek_multi_type &d) {
+			reply_entries(response, context, d, args.fragment_entries);
+			if (!d.empty()) {
+				m_pop_rate.update(d.sizes().size());
+			}
+
+			m_pop_time.add(microseconds_now() - start_time);
+
+			COCAINE_LOG_INFO(m_log, "%s, peeked %ld entries, %ld bytes (asked %d, max-bytes %ld)",
+					action_id.c_str(),
+					d.sizes().size(), d.data().size(), num, max_bytes
+					);
+		});
+
 	} else if (event == "ack") {
 		m_ack_time.start();
 		ioremap::elliptics::data_pointer d = context.data();
@@ -256,6 +475,78 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 				d.size()
 				);
 
+	} else if (event == "ack-range") {
+		m_ack_time.start();
+		auto d = ioremap::grape::deserialize<ack_range_type>(context.data());
+
+		uint64_t count = m_queue->statistics().ack_count;
+		m_queue->ack(d);
+		count = m_queue->statistics().ack_count - count;
+		m_queue->final(response, context, ioremap::elliptics::data_pointer());
+
+		m_ack_time.stop();
+		m_ack_rate.update(count);
+
+		COCAINE_LOG_INFO(m_log, "%s, acked %ld entries in %ld ranges",
+				action_id.c_str(),
+				count, d.size()
+				);
+
+	} else if (event == "ack-upto") {
+		m_ack_time.start();
+		auto entry_id = ioremap::grape::deserialize<ioremap::grape::entry_id>(context.data());
+
+		uint64_t count = m_queue->statistics().ack_count;
+		m_queue->ack_upto(entry_id);
+		count = m_queue->statistics().ack_count - count;
+		m_queue->final(response, context, ioremap::elliptics::data_pointer());
+
+		m_ack_time.stop();
+		m_ack_rate.update(count);
+
+		COCAINE_LOG_INFO(m_log, "%s, acked %ld entries up to %d-%d",
+				action_id.c_str(),
+				count, entry_id.chunk, entry_id.pos
+				);
+
+	} else if (event == "extend") {
+		auto d = ioremap::grape::deserialize<extend_type>(context.data());
+
+		m_queue->extend(d.first, (uint64_t)d.second * 1000);
+		m_queue->final(response, context, ioremap::elliptics::data_pointer());
+
+		COCAINE_LOG_INFO(m_log, "%s, extended %ld ranges, time %d ms",
+				action_id.c_str(),
+				d.first.size(), d.second
+				);
+
+	} else if (event == "nack") {
+		ioremap::grape::entry_id entry_id = ioremap::grape::entry_id::from_dnet_raw_id(context.src_id());
+		// optional delay of the redelivery in milliseconds
+		int delay_ms = 0;
+		if (!context.data().empty()) {
+			delay_ms = stoi(context.data().to_string());
+		}
+
+		m_queue->nack(std::vector<ioremap::grape::entry_id>(1, entry_id), (uint64_t)delay_ms * 1000);
+		m_queue->final(response, context, ioremap::elliptics::data_pointer());
+
+		COCAINE_LOG_INFO(m_log, "%s, nacked entry %d-%d, delay %d ms",
+				action_id.c_str(),
+				entry_id.chunk, entry_id.pos, delay_ms
+				);
+
+	} else if (event == "nack-multi") {
+		auto d = ioremap::grape::deserialize<nack_multi_type>(context.data());
+
+		m_queue->nack(d.first, (uint64_t)d.second * 1000);
+		m_queue->final(response, context, ioremap::elliptics::data_pointer());
+
+		COCAINE_LOG_INFO(m_log, "%s, nacked %ld entries, delay %d ms",
+				action_id.c_str(),
+				d.first.size(), d.second
+				);
+
 	} else if (event == "clear") {
 		// clear queue content
 		m_queue->clear();
@@ -284,9 +575,29 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 		root.AddMember("high-id", state.chunk_id_push, root.GetAllocator());
 		root.AddMember("low-id", state.chunk_id_ack, root.GetAllocator());
 
+		// chunk ids of every priority lane, lane 0 is the one above
+		rapidjson::Value lanes;
+		lanes.SetArray();
+		for (int lane = 0; lane < m_queue->lanes(); ++lane) {
+			const ioremap::grape::queue_state &lane_state = m_queue->state(lane);
+			rapidjson::Value ids;
+			ids.SetObject();
+			ids.AddMember("high-id", lane_state.chunk_id_push, root.GetAllocator());
+			ids.AddMember("low-id", lane_state.chunk_id_ack, root.GetAllocator());
+			// lane is stopped at the chunk which has lost its meta
+			ids.AddMember("missing-id", m_queue->missing_chunk(lane), root.GetAllocator());
+			lanes.PushBack(ids, root.GetAllocator());
+		}
+		root.AddMember("lanes", lanes, root.GetAllocator());
+
 		root.AddMember("push.count", st.push_count, root.GetAllocator());
 		root.AddMember("pop.count", st.pop_count, root.GetAllocator());
 		root.AddMember("ack.count", st.ack_count, root.GetAllocator());
+		root.AddMember("nack.count", st.nack_count, root.GetAllocator());
+		root.AddMember("dead_letter.count", st.dead_letter_count, root.GetAllocator());
+		root.AddMember("delay.count", st.delay_count, root.GetAllocator());
+		root.AddMember("promote.count", st.promote_count, root.GetAllocator());
+		root.AddMember("expire.count", st.expire_count, root.GetAllocator());
 		root.AddMember("push.rate", m_push_rate.get(), root.GetAllocator());
 		root.AddMember("pop.rate", m_pop_rate.get(), root.GetAllocator());
 		root.AddMember("ack.rate", m_ack_rate.get(), root.GetAllocator());
@@ -298,6 +609,7 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 
 		root.AddMember("chunks_popped.write_data", st.chunks_popped.write_data, root.GetAllocator());
 		root.AddMember("chunks_popped.write_meta", st.chunks_popped.write_meta, root.GetAllocator());
+		root.AddMember("chunks_popped.write_journal", st.chunks_popped.write_journal, root.GetAllocator());
 		root.AddMember("chunks_popped.read", st.chunks_popped.read, root.GetAllocator());
 		root.AddMember("chunks_popped.remove", st.chunks_popped.remove, root.GetAllocator());
 		root.AddMember("chunks_popped.push", st.chunks_popped.push, root.GetAllocator());
@@ -306,12 +618,28 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 
 		root.AddMember("chunks_pushed.write_data", st.chunks_pushed.write_data, root.GetAllocator());
 		root.AddMember("chunks_pushed.write_meta", st.chunks_pushed.write_meta, root.GetAllocator());
+		root.AddMember("chunks_pushed.write_journal", st.chunks_pushed.write_journal, root.GetAllocator());
 		root.AddMember("chunks_pushed.read", st.chunks_pushed.read, root.GetAllocator());
 		root.AddMember("chunks_pushed.remove", st.chunks_pushed.remove, root.GetAllocator());
 		root.AddMember("chunks_pushed.push", st.chunks_pushed.push, root.GetAllocator());
 		root.AddMember("chunks_pushed.pop", st.chunks_pushed.pop, root.GetAllocator());
 		root.AddMember("chunks_pushed.ack", st.chunks_pushed.ack, root.GetAllocator());
 
+		// resident data cache, total and by chunk
+		rapidjson::Value cache_chunks;
+		cache_chunks.SetObject();
+		uint64_t cache_bytes = 0;
+		for (const auto &usage : m_queue->cache_usage()) {
+			std::string chunk_id = std::to_string(usage.first);
+			rapidjson::Value key(chunk_id.c_str(), chunk_id.size(), root.GetAllocator());
+			rapidjson::Value bytes(usage.second);
+			cache_chunks.AddMember(key, bytes, root.GetAllocator());
+			cache_bytes += usage.second;
+		}
+		root.AddMember("cache.bytes", cache_bytes, root.GetAllocator());
+		root.AddMember("cache.evict_count", st.cache_evict_count, root.GetAllocator());
+		root.AddMember("cache.chunks", cache_chunks, root.GetAllocator());
+
 		root.Accept(writer);
 
 		m_queue->final(response, context, ioremap::elliptics::data_pointer::from_raw(const_cast<char*>(stream.GetString()), stream.GetSize()));
@@ -6,185 +6,552 @@ extern std::shared_ptr<cocaine::framework::logger_t> grape_queue_module_get_logg
 #define LOG_DEBUG(...) COCAINE_LOG_DEBUG(grape_queue_module_get_logger(), __VA_ARGS__)
 
 ioremap::grape::chunk_meta::chunk_meta(int max)
-	: m_ptr(NULL)
+	: m_max(max)
+	, m_low(0)
+	, m_high(0)
+	, m_acked(0)
+	, m_offsets(1, 0)
+	, m_expire_known(false)
+	, m_expire_all(0)
 {
-	m_data.resize(sizeof(struct chunk_disk) + max * sizeof(struct chunk_entry));
-	m_ptr = (struct chunk_disk *)m_data.data();
-
-	m_ptr->max = max;
 }
 
-bool ioremap::grape::chunk_meta::push(int size)
+bool ioremap::grape::chunk_meta::push(int size, uint32_t expire)
 {
-	if (m_ptr->high >= m_ptr->max)
-		ioremap::elliptics::throw_error(-ERANGE, "chunk is full: high: %d, max: %d", m_ptr->high, m_ptr->max);
+	if (m_high >= m_max)
+		ioremap::elliptics::throw_error(-ERANGE, "chunk is full: high: %d, max: %d", m_high, m_max);
+
+	// expiry times are kept once any entry expires, entries before it never do
+	if (expire || !m_expires.empty()) {
+		m_expires.resize(m_high, 0);
+		m_expires.push_back(expire);
+	}
+	m_expire_known = false;
 
-	m_ptr->entries[m_ptr->high].size = size;
-	m_ptr->high++;
+	m_sizes.push_back(size);
+	m_acked_map.push_back(false);
+	m_offsets.push_back(m_offsets.back() + size);
+	m_high++;
 
-	LOG_DEBUG("\tmeta.push: acked: %d, low: %d, high: %d, max: %d", m_ptr->acked, m_ptr->low, m_ptr->high, m_ptr->max);
+	LOG_DEBUG("\tmeta.push: acked: %d, low: %d, high: %d, max: %d", m_acked, m_low, m_high, m_max);
 
 	return full();
 }
 
 void ioremap::grape::chunk_meta::pop()
 {
-	if (m_ptr->high > m_ptr->max) {
+	if (m_high > m_max) {
 		ioremap::elliptics::throw_error(-ERANGE, "invalid pop: high mark can not be more than maximum chunk size: "
 				"low: %d, high: %d, max: %d",
-				m_ptr->low, m_ptr->high, m_ptr->max);
+				m_low, m_high, m_max);
 	}
 
-	if (m_ptr->low >= m_ptr->high) {
+	if (m_low >= m_high) {
 		ioremap::elliptics::throw_error(-ERANGE, "invalid pop: position can not be more than high mark: "
 				"low: %d, high: %d, max: %d",
-				m_ptr->low, m_ptr->high, m_ptr->max);
+				m_low, m_high, m_max);
 	}
 
-	m_ptr->low++;
+	m_low++;
 
-	LOG_DEBUG("\tmeta.pop: acked: %d, low: %d, high: %d, max: %d", m_ptr->acked, m_ptr->low, m_ptr->high, m_ptr->max);
+	LOG_DEBUG("\tmeta.pop: acked: %d, low: %d, high: %d, max: %d", m_acked, m_low, m_high, m_max);
 }
 
 bool ioremap::grape::chunk_meta::ack(int32_t pos, int state)
 {
-	if (pos >= m_ptr->low) {
+	if (pos >= m_low) {
 		ioremap::elliptics::throw_error(-ERANGE, "invalid ack: position can not be more than low mark: "
 				"pos: %d, acked: %d, low: %d, high: %d, max: %d",
-				pos, m_ptr->acked, m_ptr->low, m_ptr->high, m_ptr->max);
+				pos, m_acked, m_low, m_high, m_max);
 	}
 
-	if (pos >= m_ptr->high) {
+	if (pos >= m_high) {
 		ioremap::elliptics::throw_error(-ERANGE, "invalid ack: position can not be more than high mark: "
 				"pos: %d, acked: %d, high: %d, max: %d",
-				pos, m_ptr->acked, m_ptr->high, m_ptr->max);
+				pos, m_acked, m_high, m_max);
 	}
 
-	if (pos >= m_ptr->max) {
+	if (pos >= m_max) {
 		ioremap::elliptics::throw_error(-ERANGE, "invalid ack: position can not be more than maximum chunk size: "
 				"pos: %d, acked: %d, high: %d, max: %d",
-				pos, m_ptr->acked, m_ptr->high, m_ptr->max);
+				pos, m_acked, m_high, m_max);
 	}
 
-	chunk_entry &entry = m_ptr->entries[pos];
-	if (entry.state != state && state == chunk_entry::STATE_ACKED) {
-		if (m_ptr->acked >= m_ptr->high) {
+	bool acked = (state == chunk_entry::STATE_ACKED);
+	if (acked && !m_redelivered.empty()) {
+		m_redelivered.erase(pos);
+	}
+	if (!m_acked_map[pos] && acked) {
+		if (m_acked >= m_high) {
 			ioremap::elliptics::throw_error(-ERANGE, "invalid ack: acked can not be more than high mark: "
 					"pos: %d, acked: %d, high: %d, max: %d",
-					pos, m_ptr->acked, m_ptr->high, m_ptr->max);
+					pos, m_acked, m_high, m_max);
 		}
 
-		if (m_ptr->acked >= m_ptr->low) {
+		if (m_acked >= m_low) {
 			ioremap::elliptics::throw_error(-ERANGE, "invalid ack: acked can not be more than low mark: "
 					"pos: %d, acked: %d, low: %d, high: %d, max: %d",
-					pos, m_ptr->acked, m_ptr->low, m_ptr->high, m_ptr->max);
+					pos, m_acked, m_low, m_high, m_max);
 		}
 
-		m_ptr->acked++;
+		m_acked++;
 	} else {
-		LOG_INFO("\tmeta.ack: pos: %d, was already acked", pos, entry.state);
+		LOG_INFO("\tmeta.ack: pos: %d, was already acked", pos, (int)m_acked_map[pos]);
 	}
-	entry.state = state;
-	LOG_DEBUG("\tmeta.ack: pos: %d, acked: %d, low: %d, high: %d, max: %d", pos, m_ptr->acked, m_ptr->low, m_ptr->high, m_ptr->max);
+	m_acked_map[pos] = acked;
+	LOG_DEBUG("\tmeta.ack: pos: %d, acked: %d, low: %d, high: %d, max: %d", pos, m_acked, m_low, m_high, m_max);
 
 	return complete();
 }
 
+int ioremap::grape::chunk_meta::ack_range(int32_t from, int32_t to)
+{
+	if (from < 0 || from > to || to >= m_low) {
+		ioremap::elliptics::throw_error(-ERANGE, "invalid ack range: range must be within popped entries: "
+				"from: %d, to: %d, acked: %d, low: %d, high: %d, max: %d",
+				from, to, m_acked, m_low, m_high, m_max);
+	}
+
+	int count = 0;
+	for (int32_t pos = from; pos <= to; ++pos) {
+		if (!m_acked_map[pos]) {
+			m_acked_map[pos] = true;
+			++count;
+		}
+	}
+	m_acked += count;
+
+	if (!m_redelivered.empty()) {
+		for (auto i = m_redelivered.begin(); i != m_redelivered.end();) {
+			if (i->first >= from && i->first <= to) {
+				i = m_redelivered.erase(i);
+			} else {
+				++i;
+			}
+		}
+	}
+
+	LOG_DEBUG("\tmeta.ack_range: from: %d, to: %d, newly acked: %d, acked: %d, low: %d, high: %d, max: %d",
+			from, to, count, m_acked, m_low, m_high, m_max);
+
+	return count;
+}
+
+int ioremap::grape::chunk_meta::redelivered(int32_t pos)
+{
+	return ++m_redelivered[pos] + 1;
+}
+
+int ioremap::grape::chunk_meta::attempts(int32_t pos) const
+{
+	auto found = m_redelivered.find(pos);
+	return found == m_redelivered.end() ? 1 : found->second + 1;
+}
+
+bool ioremap::grape::chunk_meta::expiring() const
+{
+	return !m_expires.empty();
+}
+
+uint32_t ioremap::grape::chunk_meta::expire(int32_t pos) const
+{
+	return m_expires.empty() ? 0 : m_expires[pos];
+}
+
+bool ioremap::grape::chunk_meta::expired(int32_t pos, uint32_t now) const
+{
+	uint32_t at = expire(pos);
+	return at && at <= now;
+}
+
+bool ioremap::grape::chunk_meta::expired(uint32_t now) const
+{
+	if (!full() || m_high == 0 || !expiring()) {
+		return false;
+	}
+
+	// full chunk gets no more entries, so its expiry time is found only once
+	if (!m_expire_known) {
+		bool never = std::find(m_expires.begin(), m_expires.end(), 0) != m_expires.end();
+		m_expire_all = never ? 0 : *std::max_element(m_expires.begin(), m_expires.end());
+		m_expire_known = true;
+	}
+	return m_expire_all && m_expire_all <= now;
+}
+
+void ioremap::grape::chunk_meta::seal()
+{
+	LOG_INFO("\tmeta.seal: acked: %d, low: %d, high: %d, max: %d", m_acked, m_low, m_high, m_max);
+
+	m_max = m_high;
+}
+
+bool ioremap::grape::chunk_meta::replay(const chunk_journal_record &record)
+{
+	switch (record.type) {
+	case chunk_journal_record::PUSH:
+		if (record.pos < 0 || record.pos >= m_max) {
+			return false;
+		}
+		if (record.pos >= m_high) {
+			m_high = record.pos + 1;
+			m_sizes.resize(m_high, 0);
+			m_acked_map.resize(m_high, false);
+			if (!m_expires.empty()) {
+				m_expires.resize(m_high, 0);
+			}
+			m_expire_known = false;
+		}
+		if (m_sizes[record.pos] != record.size || (int)m_offsets.size() != m_high + 1) {
+			m_sizes[record.pos] = record.size;
+			rebuild_offsets(record.pos);
+		}
+		return true;
+
+	case chunk_journal_record::ACK:
+		if (record.pos < 0 || record.pos >= m_high) {
+			return false;
+		}
+		// acked entry had been popped for sure
+		m_low = std::max(m_low, record.pos + 1);
+		if (!m_acked_map[record.pos]) {
+			m_acked_map[record.pos] = true;
+			m_acked++;
+		}
+		return true;
+
+	case chunk_journal_record::ACK_RANGE:
+		if (record.pos < 0 || record.pos > record.size || record.size >= m_high) {
+			return false;
+		}
+		m_low = std::max(m_low, record.size + 1);
+		ack_range(record.pos, record.size);
+		return true;
+
+	case chunk_journal_record::ATTEMPT:
+		if (record.pos < 0 || record.pos >= m_high || record.size < 0) {
+			return false;
+		}
+		// count of the acked entry is not needed anymore
+		if (!m_acked_map[record.pos] && record.size > 0) {
+			int &count = m_redelivered[record.pos];
+			count = std::max(count, record.size);
+		}
+		return true;
+
+	case chunk_journal_record::EXPIRE:
+		if (record.pos < 0 || record.pos >= m_high) {
+			return false;
+		}
+		if (m_expires.empty()) {
+			m_expires.resize(m_high, 0);
+		}
+		m_expires[record.pos] = (uint32_t)record.size;
+		m_expire_known = false;
+		return true;
+	}
+
+	return false;
+}
+
 std::string &ioremap::grape::chunk_meta::data()
 {
+	int max_size = 0;
+	for (auto size : m_sizes) {
+		max_size = std::max(max_size, size);
+	}
+
+	chunk_disk_header header;
+	header.magic = chunk_disk_header::MAGIC;
+	header.version = !m_redelivered.empty() ? chunk_disk_header::VERSION_ATTEMPTS :
+		!m_expires.empty() ? chunk_disk_header::VERSION_EXPIRES : chunk_disk_header::VERSION;
+	header.size_width = (max_size <= 0xff) ? 1 : (max_size <= 0xffff) ? 2 : 4;
+	header.max = m_max;
+	header.low = m_low;
+	header.high = m_high;
+	header.acked = m_acked;
+
+	// expiries section is written from version 3 on, attempts section in version 4
+	size_t expires_size = header.version != chunk_disk_header::VERSION ? m_high * 4 : 0;
+	size_t attempts_size = header.version == chunk_disk_header::VERSION_ATTEMPTS ? 4 + m_redelivered.size() * 8 : 0;
+
+	m_data.assign((const char *)&header, sizeof(header));
+	m_data.reserve(sizeof(header) + m_high * header.size_width + (m_high + 7) / 8 + expires_size + attempts_size);
+
+	for (auto size : m_sizes) {
+		// little endian, lowest @size_width bytes
+		for (int i = 0; i < header.size_width; ++i) {
+			m_data.push_back((char)((uint32_t)size >> (8 * i)));
+		}
+	}
+
+	char bits = 0;
+	for (int i = 0; i < m_high; ++i) {
+		if (m_acked_map[i]) {
+			bits |= 1 << (i % 8);
+		}
+		if (i % 8 == 7) {
+			m_data.push_back(bits);
+			bits = 0;
+		}
+	}
+	if (m_high % 8) {
+		m_data.push_back(bits);
+	}
+
+	auto push_uint32 = [this] (uint32_t value) {
+		for (int i = 0; i < 4; ++i) {
+			m_data.push_back((char)(value >> (8 * i)));
+		}
+	};
+
+	if (header.version != chunk_disk_header::VERSION) {
+		for (int i = 0; i < m_high; ++i) {
+			push_uint32(m_expires.empty() ? 0 : m_expires[i]);
+		}
+	}
+
+	if (header.version == chunk_disk_header::VERSION_ATTEMPTS) {
+		push_uint32(m_redelivered.size());
+		for (const auto &r : m_redelivered) {
+			push_uint32(r.first);
+			push_uint32(r.second);
+		}
+	}
+
 	return m_data;
 }
 
+int ioremap::grape::chunk_meta::max() const
+{
+	return m_max;
+}
+
 int ioremap::grape::chunk_meta::low_mark() const
 {
-	return m_ptr->low;
+	return m_low;
 }
 
 int ioremap::grape::chunk_meta::high_mark() const
 {
-	return m_ptr->high;
+	return m_high;
 }
 
 int ioremap::grape::chunk_meta::acked() const
 {
-	return m_ptr->acked;
+	return m_acked;
 }
 
 bool ioremap::grape::chunk_meta::full() const
 {
-	return m_ptr->high == m_ptr->max;
+	return m_high == m_max;
 }
 
 bool ioremap::grape::chunk_meta::exhausted() const
 {
-	return m_ptr->low == m_ptr->max;
+	return m_low == m_max;
 }
 
 bool ioremap::grape::chunk_meta::complete() const
 {
-	return m_ptr->acked == m_ptr->max;
+	return m_acked == m_max;
 }
 
 void ioremap::grape::chunk_meta::assign(char *data, size_t size)
 {
-	if (size != m_data.size()) {
-		ioremap::elliptics::throw_error(-ERANGE, "chunk meta assignment with invalid size: current: %ld, want-to-assign: %ld",
-				m_data.size(), size);
+	const chunk_disk_header *header = (const chunk_disk_header *)data;
+	if (size >= sizeof(chunk_disk_header) && header->magic == chunk_disk_header::MAGIC) {
+		assign_compact(data, size);
+	} else {
+		assign_legacy(data, size);
+	}
+
+	rebuild_offsets(0);
+	m_expire_known = false;
+
+	LOG_INFO("\tmeta.assign: acked: %d, low: %d, high: %d, max: %d", m_acked, m_low, m_high, m_max);
+}
+
+void ioremap::grape::chunk_meta::rebuild_offsets(int from)
+{
+	from = std::min(from, (int)m_offsets.size() - 1);
+
+	m_offsets.resize(m_high + 1);
+	for (int i = from; i < m_high; ++i) {
+		m_offsets[i + 1] = m_offsets[i] + m_sizes[i];
+	}
+}
+
+void ioremap::grape::chunk_meta::assign_compact(char *data, size_t size)
+{
+	const chunk_disk_header *header = (const chunk_disk_header *)data;
+
+	if (header->version != chunk_disk_header::VERSION && header->version != chunk_disk_header::VERSION_EXPIRES
+			&& header->version != chunk_disk_header::VERSION_ATTEMPTS) {
+		ioremap::elliptics::throw_error(-ERANGE, "chunk meta assignment with unknown version: %d", header->version);
+	}
+
+	if (header->size_width != 1 && header->size_width != 2 && header->size_width != 4) {
+		ioremap::elliptics::throw_error(-ERANGE, "chunk meta assignment with invalid size width: %d", header->size_width);
+	}
+
+	if (header->high < 0 || header->high > header->max || header->low < 0 || header->low > header->high
+			|| header->acked < 0 || header->acked > header->low) {
+		ioremap::elliptics::throw_error(-ERANGE, "chunk meta assignment with invalid marks: "
+				"acked: %d, low: %d, high: %d, max: %d",
+				header->acked, header->low, header->high, header->max);
+	}
+
+	auto read_uint32 = [] (const unsigned char *p) {
+		uint32_t value = 0;
+		for (int b = 0; b < 4; ++b) {
+			value |= (uint32_t)p[b] << (8 * b);
+		}
+		return value;
+	};
+
+	size_t expires_width = (header->version != chunk_disk_header::VERSION) ? 4 : 0;
+	size_t want_size = sizeof(chunk_disk_header) + header->high * (header->size_width + expires_width) + (header->high + 7) / 8;
+	size_t attempts_offset = want_size;
+	uint32_t attempts_count = 0;
+	if (header->version == chunk_disk_header::VERSION_ATTEMPTS) {
+		if (size < want_size + 4) {
+			ioremap::elliptics::throw_error(-ERANGE, "chunk meta assignment with invalid size: want more than: %ld, want-to-assign: %ld",
+					want_size + 4, size);
+		}
+		attempts_count = read_uint32((const unsigned char *)data + attempts_offset);
+		want_size += 4 + (size_t)attempts_count * 8;
+	}
+	if (size != want_size) {
+		ioremap::elliptics::throw_error(-ERANGE, "chunk meta assignment with invalid size: want: %ld, want-to-assign: %ld",
+				want_size, size);
+	}
+
+	m_max = header->max;
+	m_low = header->low;
+	m_high = header->high;
+	m_acked = header->acked;
+
+	const unsigned char *sizes = (const unsigned char *)data + sizeof(chunk_disk_header);
+	m_sizes.resize(m_high);
+	for (int i = 0; i < m_high; ++i) {
+		uint32_t entry_size = 0;
+		for (int b = 0; b < header->size_width; ++b) {
+			entry_size |= (uint32_t)sizes[i * header->size_width + b] << (8 * b);
+		}
+		m_sizes[i] = entry_size;
+	}
+
+	const unsigned char *bits = sizes + m_high * header->size_width;
+	m_acked_map.resize(m_high);
+	for (int i = 0; i < m_high; ++i) {
+		m_acked_map[i] = bits[i / 8] & (1 << (i % 8));
+	}
+
+	m_expires.clear();
+	if (expires_width) {
+		const unsigned char *expires = bits + (m_high + 7) / 8;
+		m_expires.resize(m_high);
+		for (int i = 0; i < m_high; ++i) {
+			m_expires[i] = read_uint32(expires + i * 4);
+		}
+		// version 4 has the section even if nothing expires
+		if (std::all_of(m_expires.begin(), m_expires.end(), [] (uint32_t expire) { return expire == 0; })) {
+			m_expires.clear();
+		}
+	}
+
+	m_redelivered.clear();
+	const unsigned char *attempts = (const unsigned char *)data + attempts_offset + 4;
+	for (uint32_t i = 0; i < attempts_count; ++i) {
+		int32_t pos = read_uint32(attempts + i * 8);
+		int count = read_uint32(attempts + i * 8 + 4);
+		if (pos >= 0 && pos < m_high && !m_acked_map[pos] && count > 0) {
+			m_redelivered[pos] = count;
+		}
+	}
+}
+
+void ioremap::grape::chunk_meta::assign_legacy(char *data, size_t size)
+{
+	const chunk_disk *disk = (const chunk_disk *)data;
+
+	if (size < sizeof(chunk_disk) || disk->max < 0 || size != sizeof(chunk_disk) + disk->max * sizeof(chunk_entry)) {
+		ioremap::elliptics::throw_error(-ERANGE, "chunk meta assignment with invalid size: max: %d, want-to-assign: %ld",
+				size < sizeof(chunk_disk) ? -1 : disk->max, size);
 	}
 
-	m_data.assign(data, size);
-	m_ptr = (struct chunk_disk *)m_data.data();
+	if (disk->high < 0 || disk->high > disk->max) {
+		ioremap::elliptics::throw_error(-ERANGE, "chunk meta assignment with invalid high mark: high: %d, max: %d",
+				disk->high, disk->max);
+	}
 
-	// // acked count validation
-	// int acked = 0;
-	// for (int i = 0; i < m_ptr->high; ++i) {
-	// 	if (m_ptr->entries[i].state == 1) {
-	// 		++acked;
-	// 	}
-	// }
-	// if (acked != m_ptr->acked) {
-	// 	LOG_ERROR("invalid acked count: read %d, actual %d", m_ptr->acked, acked);
-	// }
+	m_max = disk->max;
+	m_low = disk->low;
+	m_high = disk->high;
+	m_acked = disk->acked;
+
+	// legacy layout has records for all possible entries, only pushed ones are kept
+	m_sizes.resize(m_high);
+	m_acked_map.resize(m_high);
+	for (int i = 0; i < m_high; ++i) {
+		m_sizes[i] = disk->entries[i].size;
+		m_acked_map[i] = (disk->entries[i].state == chunk_entry::STATE_ACKED);
+	}
+	m_expires.clear();
+	m_redelivered.clear();
 }
 
 ioremap::grape::chunk_entry ioremap::grape::chunk_meta::operator[] (int32_t pos) const
 {
-	if (pos > m_ptr->high) {
+	if (pos < 0 || pos >= m_high) {
 		ioremap::elliptics::throw_error(-ERANGE, "invalid entry access: pos: %d, high: %d, max: %d",
-				pos, m_ptr->high, m_ptr->max);
+				pos, m_high, m_max);
 	}
 
-	return m_ptr->entries[pos];
+	chunk_entry entry;
+	entry.size = m_sizes[pos];
+	entry.state = m_acked_map[pos] ? chunk_entry::STATE_ACKED : 0;
+	return entry;
 }
 
 uint64_t ioremap::grape::chunk_meta::byte_offset(int32_t pos) const
 {
-	if (pos > m_ptr->high) {
+	if (pos > m_high) {
 		ioremap::elliptics::throw_error(-ERANGE, "invalid entry access: pos: %d, high: %d, max: %d",
-				pos, m_ptr->high, m_ptr->max);
+				pos, m_high, m_max);
 	}
 
-	uint64_t offset = 0;
-	for (int i = 0; i < pos; ++i) {
-		offset += m_ptr->entries[i].size;
-	}
-
-	return offset;
+	return m_offsets[pos];
 }
 
-ioremap::grape::chunk::chunk(ioremap::elliptics::session &session, const std::string &queue_id, int chunk_id, int max)
+ioremap::grape::chunk::chunk(ioremap::elliptics::session &session, const std::string &queue_id, int chunk_id, int max, int journal_max)
 	: m_chunk_id(chunk_id)
 	, m_data_key(queue_id + ".chunk." + std::to_string(chunk_id))
 	, m_meta_key(queue_id + ".chunk." + std::to_string(chunk_id) + ".meta")
+	, m_journal_key(queue_id + ".chunk." + std::to_string(chunk_id) + ".journal")
 	, m_session_data(session.clone())
 	, m_session_meta(session.clone())
+	, m_session_journal(session.clone())
+	, m_prefetch_offset(0)
+	, m_prefetching(false)
 	, m_meta(max)
-	, m_fire_time(0)
+	, m_next_write_id(0)
+	, m_reserved(0)
+	, m_reserved_bytes(0)
+	, m_closed(false)
+	, m_journal_records(0)
+	, m_journal_max(journal_max)
+	, m_folding(false)
+	, m_loaded(false)
+	, m_data_wanted(false)
+	, m_budget_reached(false)
 {
 	m_traceid = cocaine::format("%s, chunk %d", queue_id, m_chunk_id);
 
-	m_session_data.set_ioflags(DNET_IO_FLAGS_APPEND | DNET_IO_FLAGS_NOCSUM);
+	m_session_data.set_ioflags(DNET_IO_FLAGS_NOCSUM);
 	m_session_meta.set_ioflags(DNET_IO_FLAGS_NOCSUM | DNET_IO_FLAGS_OVERWRITE);
+	m_session_journal.set_ioflags(DNET_IO_FLAGS_APPEND | DNET_IO_FLAGS_NOCSUM);
 
 	// prepare io attrs for data and meta
 	auto init_io_attr = [] (dnet_io_attr *io, ioremap::elliptics::session &session, const std::string &key) {
@@ -205,32 +572,144 @@ ioremap::grape::chunk::~chunk()
 	//write_meta();
 }
 
+namespace {
+	void wait_read(ioremap::elliptics::async_read_result &result,
+			ioremap::elliptics::data_pointer *d, ioremap::elliptics::error_info *error)
+	{
+		try {
+			*d = result.get_one().file();
+		} catch (const ioremap::elliptics::error &e) {
+			*error = ioremap::elliptics::error_info(e.error_code(), std::string(e.what()));
+		}
+	}
+}
+
 bool ioremap::grape::chunk::load_meta()
+{
+	// base meta and journal are independent, so both are read at once
+	auto meta_result = read_meta();
+	auto journal_result = read_journal();
+
+	ioremap::elliptics::data_pointer meta, journal;
+	ioremap::elliptics::error_info meta_error, journal_error;
+	wait_read(meta_result, &meta, &meta_error);
+	wait_read(journal_result, &journal, &journal_error);
+
+	return load_complete(meta, meta_error, journal, journal_error);
+}
+
+ioremap::elliptics::async_read_result ioremap::grape::chunk::read_meta()
 {
 	//DEBUG
 	LOG_INFO("%s, load_meta, reading %s - %s", m_traceid.c_str(), dnet_dump_id_str(m_meta_io.id), m_meta_key.remote().c_str());
 
-	try {
-		ioremap::elliptics::data_pointer d = m_session_meta.read_data(m_meta_key, 0, 0).get_one().file();
-		m_meta.assign((char *)d.data(), d.size());
+	return m_session_meta.read_data(m_meta_key, 0, 0);
+}
+
+ioremap::elliptics::async_read_result ioremap::grape::chunk::read_journal()
+{
+	LOG_INFO("%s, load_journal, reading %s", m_traceid.c_str(), m_journal_key.remote().c_str());
+
+	return m_session_meta.read_data(m_journal_key, 0, 0);
+}
+
+bool ioremap::grape::chunk::load_complete(const ioremap::elliptics::data_pointer &meta, const ioremap::elliptics::error_info &meta_error,
+		const ioremap::elliptics::data_pointer &journal, const ioremap::elliptics::error_info &journal_error)
+{
+	if (m_loaded) {
+		// loaded by somebody else meanwhile, what is in memory is more recent
+		LOG_INFO("%s, load_meta, already loaded", m_traceid.c_str());
+		return true;
+	}
+
+	bool found = false;
+
+	if (!meta_error) {
+		try {
+			m_meta.assign((char *)meta.data(), meta.size());
+			++m_stat.read;
+			found = true;
+
+		} catch (const ioremap::elliptics::error &e) {
+			// special case to ignore bad chunk meta format error
+			// (raised by chunk_clt::assign())
+			LOG_ERROR("%s, load_meta, ERROR: error reading meta: %s", m_traceid.c_str(), e.what());
+			if (e.error_code() != -ERANGE) {
+				throw;
+			}
+		}
+
+	} else if (meta_error.code() == -ENOENT) {
+		// ignore not-found error - create empty chunk
+		// (but journal still could have something)
+		LOG_ERROR("%s, load_meta, ERROR: meta not found: %s", m_traceid.c_str(), meta_error.message().c_str());
+
+	} else {
+		LOG_ERROR("%s, load_meta, ERROR: error reading meta: %s", m_traceid.c_str(), meta_error.message().c_str());
+		ioremap::elliptics::throw_error(meta_error.code(), "%s: error reading meta: %s", m_traceid.c_str(), meta_error.message().c_str());
+	}
+
+	if (!journal_error) {
 		++m_stat.read;
+		if (apply_journal(journal)) {
+			found = true;
+		}
+
+	} else if (journal_error.code() == -ENOENT) {
+		LOG_INFO("%s, load_journal, no journal: %s", m_traceid.c_str(), journal_error.message().c_str());
+
+	} else {
+		LOG_ERROR("%s, load_journal, ERROR: error reading journal: %s", m_traceid.c_str(), journal_error.message().c_str());
+		ioremap::elliptics::throw_error(journal_error.code(), "%s: error reading journal: %s", m_traceid.c_str(), journal_error.message().c_str());
+	}
+
+	if (found) {
+		m_reserved = m_meta.high_mark();
+		m_reserved_bytes = m_meta.byte_offset(m_reserved);
 		reset_iteration_mode();
-		return true;
+	}
 
-	} catch (const ioremap::elliptics::not_found_error &e) {
-		// ignore not-found exception - create empty chunk
-		LOG_ERROR("%s, load_meta, ERROR: meta not found: %s", m_traceid.c_str(), e.what());
+	m_loaded = true;
 
-	} catch (const ioremap::elliptics::error &e) {
-		// special case to ignore bad chunk meta format error
-		// (raised by chunk_clt::assign())
-		LOG_ERROR("%s, load_meta, ERROR: error reading meta: %s", m_traceid.c_str(), e.what());
-		if (e.error_code() != -ERANGE) {
-			throw;
+	return found;
+}
+
+bool ioremap::grape::chunk::apply_journal(const ioremap::elliptics::data_pointer &d)
+{
+	// Partially written record at the tail (if any) is dropped, folding stops there.
+	// Records are not taken with data<T>(), which throws on a journal shorter than a record.
+	size_t count = d.size() / sizeof(chunk_journal_record);
+	if (d.size() % sizeof(chunk_journal_record)) {
+		LOG_ERROR("%s, load_journal, ERROR: torn record at the tail, %ld bytes dropped",
+				m_traceid.c_str(), d.size() % sizeof(chunk_journal_record));
+	}
+	if (count == 0) {
+		return false;
+	}
+	const chunk_journal_record *records = (const chunk_journal_record *)d.data();
+
+	for (size_t i = 0; i < count; ++i) {
+		if (!m_meta.replay(records[i])) {
+			LOG_ERROR("%s, load_journal, ERROR: bad record %ld: type %d, pos %d, size %d",
+					m_traceid.c_str(), i, records[i].type, records[i].pos, records[i].size);
 		}
 	}
+	m_journal_records = count;
 
-	return false;
+	LOG_INFO("%s, load_journal, replayed %ld records: acked %d, low %d, high %d",
+			m_traceid.c_str(), count, m_meta.acked(), m_meta.low_mark(), m_meta.high_mark());
+
+	return count > 0;
+}
+
+bool ioremap::grape::chunk::loaded() const
+{
+	return m_loaded;
+}
+
+void ioremap::grape::chunk::set_loaded()
+{
+	m_loaded = true;
 }
 
 void ioremap::grape::chunk::write_meta()
@@ -238,114 +717,122 @@ void ioremap::grape::chunk::write_meta()
 	//DEBUG
 	LOG_INFO("%s, write_meta, writing %s - %s", m_traceid.c_str(), dnet_dump_id_str(m_meta_io.id), m_meta_key.remote().c_str());
 
-	m_session_meta.write_data(m_meta_key, ioremap::elliptics::data_pointer::from_raw(m_meta.data()), 0);
+	auto result = m_session_meta.write_data(m_meta_key, ioremap::elliptics::data_pointer::from_raw(m_meta.data()), 0);
 	++m_stat.write_meta;
-}
 
-bool ioremap::grape::chunk::expect_no_more()
-{
-	return m_meta.full() && iter->at_end();
+	// meta has every published entry
+	sync_writes(result);
 }
 
-bool ioremap::grape::chunk::update_data_cache()
+void ioremap::grape::chunk::sync_writes(ioremap::elliptics::async_write_result &result)
 {
-	try {
-		// Actual data is read on first pop() and also reread on chunk's exhaustion
-		// (for data could be updated by push).
-		// Metadata is read only at start (as it resides in memory and properly updated by push).
-		//
-		if (iteration_state.byte_offset >= m_data.size()) {
-			LOG_INFO("%s, update_data_cache, (re)reading data, iteration.byte_offset %lld, m_data.size() %ld", m_traceid.c_str(), iteration_state.byte_offset, m_data.size());
-
-			//DEBUG
-			LOG_INFO("%s, update_data_cache, reading %s - %s", m_traceid.c_str(), dnet_dump_id_str(m_data_io.id), m_data_key.remote().c_str());
+	if (m_unsynced.empty()) {
+		return;
+	}
 
-			m_data = m_session_data.read_data(m_data_key, 0, 0).get_one().file();
+	auto handlers = std::make_shared<std::vector<write_handler>>();
+	handlers->swap(m_unsynced);
 
-			LOG_INFO("%s, update_data_cache, read m_data, size %ld", m_traceid.c_str(), m_data.size());
+	result.connect(ioremap::elliptics::async_write_result::result_function(),
+		[handlers] (const ioremap::elliptics::error_info &error) {
+			for (const auto &handler : *handlers) {
+				handler(error);
+			}
 		}
+	);
+}
 
-		return true;
+void ioremap::grape::chunk::journal(int32_t type, int32_t pos, int32_t size)
+{
+	m_journal.push_back(chunk_journal_record{type, pos, size});
+}
 
-	} catch (const ioremap::elliptics::not_found_error &e) {
-		// Do not explode on not-found-error, return empty data pointer
-		LOG_ERROR("%s, update_data_cache, ERROR: %s", m_traceid.c_str(), e.what());
+void ioremap::grape::chunk::write_journal()
+{
+	if (m_journal.empty() || m_folding) {
+		return;
+	}
 
-	} catch (const ioremap::elliptics::timeout_error &e) {
-		// Do not explode on timeout-error, return empty data pointer
-		LOG_ERROR("%s, update_data_cache, ERROR: %s", m_traceid.c_str(), e.what());
+	LOG_INFO("%s, write_journal, appending %ld records to %s", m_traceid.c_str(), m_journal.size(), m_journal_key.remote().c_str());
 
-		//XXX: this means we silently ignore unreachable data,
-		// and it can't be good
+	auto result = m_session_journal.write_data(m_journal_key,
+			ioremap::elliptics::data_pointer::copy(m_journal.data(), m_journal.size() * sizeof(chunk_journal_record)),
+			0);
+	++m_stat.write_journal;
 
-	} catch (const ioremap::elliptics::error &e) {
-		// Special case to ignore bad chunk meta format error
-		// (raised by chunk_clt::assign())
-		LOG_ERROR("%s, update_data_cache, ERROR: %s", m_traceid.c_str(), e.what());
-		if (e.error_code() != -ERANGE) {
-			throw;
-		}
-	}
+	// records of every published entry are in this append or in those before it
+	sync_writes(result);
 
-	return false;
+	m_journal_records += m_journal.size();
+	m_journal.clear();
 }
 
-ioremap::elliptics::data_pointer ioremap::grape::chunk::pop(int *pos)
+bool ioremap::grape::chunk::fold_needed() const
 {
-	ioremap::elliptics::data_pointer d;
-	*pos = -1;
-
-	// Fast track for the case when chunk is empty (not exist).
-	// Its valid to check only metadata as push() updates metadata in memory
-	if (m_meta.high_mark() == 0) {
-		LOG_INFO("%s, pop-single, empty", m_traceid.c_str());
-		return d;
-	}
+	return !m_folding && m_journal_records + (int)m_journal.size() > m_journal_max;
+}
 
-	if (!iter) {
-		LOG_INFO("%s, pop, initializing iterator", m_traceid.c_str());
-		reset_iteration_mode();
-	}
+ioremap::elliptics::async_write_result ioremap::grape::chunk::fold_journal()
+{
+	LOG_INFO("%s, fold_journal, folding %d records into the base meta", m_traceid.c_str(), m_journal_records + (int)m_journal.size());
 
-	LOG_INFO("%s, pop-single, iter: mode %d, index %d, offset %lld", m_traceid.c_str(), iter->mode, iteration_state.entry_index, iteration_state.byte_offset);
+	// Base meta must be in place before the journal goes away, and the journal
+	// must be gone before next records are appended, so records wait
+	// until the fold is complete. This happens once in a journal lifespan, not on every ack.
+	m_folding = true;
+	m_folded.swap(m_journal);
+	m_journal.clear();
 
-	if (iter->mode == iterator::REPLAY && iter->at_end()) {
-		LOG_INFO("%s, pop-single, iter: mode %d, index %d, offset %lld, switching to mode %d", m_traceid.c_str(), iter->mode, iteration_state.entry_index, iteration_state.byte_offset, iterator::FORWARD);
+	return m_session_meta.write_data(m_meta_key, ioremap::elliptics::data_pointer::from_raw(m_meta.data()), 0);
+}
 
-		iter.reset(new forward_iterator(iteration_state, m_meta));
-		iter->begin();
+bool ioremap::grape::chunk::fold_written(const ioremap::elliptics::error_info &error)
+{
+	if (error) {
+		// journal is still the source of truth, keep on appending to it
+		LOG_ERROR("%s, fold_journal, ERROR: base meta write failed: %s", m_traceid.c_str(), error.message().c_str());
+
+		m_journal.insert(m_journal.begin(), m_folded.begin(), m_folded.end());
+		m_folded.clear();
+		m_folding = false;
+		write_journal();
+		return false;
 	}
 
-	if (iter->at_end()) {
-		LOG_INFO("%s, pop-single, iter: mode %d, index %d, offset %lld, is at end", m_traceid.c_str(), iter->mode, iteration_state.entry_index, iteration_state.byte_offset);
-		return d;
-	}
+	// folded records are already in the base meta
+	++m_stat.write_meta;
+	m_folded.clear();
+	return true;
+}
 
-	// reread data if its too much out of sync with meta
-	if (!update_data_cache()) {
-		// There was data read error, so for now meta and data are inconsistent,
-		// but next try could fix that.
-		LOG_INFO("%s, pop, chunk temporarily exhausted", m_traceid.c_str());
-		return d;
-	}
+ioremap::elliptics::async_remove_result ioremap::grape::chunk::remove_journal()
+{
+	return m_session_meta.remove(m_journal_key);
+}
 
-	if (m_data.empty()) {
-		LOG_INFO("%s, pop, chunk temporarily unavailable", m_traceid.c_str());
-		return d;
+void ioremap::grape::chunk::fold_complete(const ioremap::elliptics::error_info &error)
+{
+	if (!error) {
+		++m_stat.remove;
+	} else if (error.code() != -ENOENT) {
+		// stale journal is harmless as replaying it over newer base changes nothing
+		// (all records could be folded before any got to the journal, hence -ENOENT)
+		LOG_ERROR("%s, fold_journal, ERROR: journal remove failed: %s", m_traceid.c_str(), error.message().c_str());
 	}
 
-	int size = m_meta[iteration_state.entry_index].size;
-	d = ioremap::elliptics::data_pointer::copy((char *)m_data.data() + iteration_state.byte_offset, size);
-	*pos = iteration_state.entry_index;
-
-	iter->advance();
+	m_folding = false;
+	m_journal_records = 0;
 
-	++m_stat.pop;
+	// records made while folding
+	write_journal();
+}
 
-	return d;
+bool ioremap::grape::chunk::expect_no_more()
+{
+	return m_meta.full() && iter->at_end();
 }
 
-ioremap::grape::data_array ioremap::grape::chunk::pop(int num)
+ioremap::grape::data_array ioremap::grape::chunk::pop(int num, uint64_t max_bytes)
 {
 	ioremap::grape::data_array ret;
 
@@ -363,6 +850,12 @@ ioremap::grape::data_array ioremap::grape::chunk::pop(int num)
 
 	entry_id entry_id;
 	entry_id.chunk = m_chunk_id;
+	m_data_wanted = false;
+	m_budget_reached = false;
+	m_expired.clear();
+	uint64_t bytes = 0;
+	// wall clock is only looked at if anything could expire
+	uint32_t now = m_meta.expiring() ? time(NULL) : 0;
 
 	while(num > 0) {
 		if (iter->mode == iterator::REPLAY && iter->at_end()) {
@@ -377,22 +870,37 @@ ioremap::grape::data_array ioremap::grape::chunk::pop(int num)
 			break;
 		}
 
-		// reread data if its too much out of sync with meta
-		if (!update_data_cache()) {
-			// There was data read error, so for now meta and data are inconsistent,
-			// but next try could fix that.
-			LOG_INFO("%s, pop, chunk temporarily exhausted", m_traceid.c_str());
-			break;
+		if (now && m_meta.expired(iteration_state.entry_index, now)) {
+			// expired entry is not given out and takes nothing from the budget, its data is not needed
+			m_expired.push_back(iteration_state.entry_index);
+			iter->advance();
+			continue;
 		}
 
-		if (m_data.empty()) {
-			LOG_INFO("%s, pop, chunk temporarily unavailable", m_traceid.c_str());
+		// entry is not in the data cache yet, it is to be read by caller
+		if (m_data.size() < m_meta.byte_offset(iteration_state.entry_index + 1)) {
+			LOG_INFO("%s, pop, iter: index %d, offset %lld, waiting for data, m_data.size() %ld",
+					m_traceid.c_str(), iteration_state.entry_index, iteration_state.byte_offset, m_data.size());
+			m_data_wanted = true;
 			break;
 		}
 
 		int size = m_meta[iteration_state.entry_index].size;
+		if (max_bytes && bytes + size > max_bytes) {
+			LOG_INFO("%s, pop, iter: index %d, entry of %d bytes is over the budget, %lld of %lld bytes popped",
+					m_traceid.c_str(), iteration_state.entry_index, size, bytes, max_bytes);
+			m_budget_reached = true;
+			break;
+		}
+		bytes += size;
+
 		entry_id.pos = iteration_state.entry_index;
-		ret.append((char *)m_data.data() + iteration_state.byte_offset, size, entry_id);
+		if (iter->mode == iterator::REPLAY) {
+			// entry was given out before the restart and is not acked, this is one more attempt
+			ret.append(m_data.data() + iteration_state.byte_offset, size, entry_id, redelivered(entry_id.pos));
+		} else {
+			ret.append(m_data.data() + iteration_state.byte_offset, size, entry_id);
+		}
 
 		//LOG_INFO("%a, pop, iter: mode %d, index %d, offset %lld", m_traceid.c_str(), iter->mode, iteration_state.entry_index, iteration_state.byte_offset));
 
@@ -406,6 +914,87 @@ ioremap::grape::data_array ioremap::grape::chunk::pop(int num)
 	return ret;
 }
 
+bool ioremap::grape::chunk::data_wanted() const
+{
+	return m_data_wanted;
+}
+
+bool ioremap::grape::chunk::budget_reached() const
+{
+	return m_budget_reached;
+}
+
+bool ioremap::grape::chunk::read(int32_t pos, ioremap::elliptics::data_pointer *d)
+{
+	if (pos < 0 || pos >= m_meta.high_mark()) {
+		LOG_ERROR("%s, read, pos %d is out of range, high mark %d", m_traceid.c_str(), pos, m_meta.high_mark());
+		return false;
+	}
+
+	if (m_data.size() < m_meta.byte_offset(pos + 1)) {
+		LOG_INFO("%s, read, pos %d is not cached, m_data.size() %ld", m_traceid.c_str(), pos, m_data.size());
+		return false;
+	}
+
+	*d = ioremap::elliptics::data_pointer::copy(m_data.data() + m_meta.byte_offset(pos), m_meta[pos].size);
+
+	++m_stat.pop;
+
+	return true;
+}
+
+uint64_t ioremap::grape::chunk::cached_bytes() const
+{
+	return m_data.size();
+}
+
+void ioremap::grape::chunk::drop_cache()
+{
+	LOG_INFO("%s, drop_cache, dropping %ld bytes", m_traceid.c_str(), m_data.size());
+
+	// release memory, not just the content
+	std::string().swap(m_data);
+}
+
+bool ioremap::grape::chunk::need_prefetch() const
+{
+	return !m_prefetching && m_data.size() < m_meta.byte_offset(m_meta.high_mark());
+}
+
+ioremap::elliptics::async_read_result ioremap::grape::chunk::prefetch()
+{
+	LOG_INFO("%s, prefetch, reading data from offset %ld, high mark %d", m_traceid.c_str(), m_data.size(), m_meta.high_mark());
+
+	m_prefetching = true;
+	m_prefetch_offset = m_data.size();
+
+	// bytes beyond published entries could be left by writes which are in flight or failed
+	++m_stat.read;
+	return m_session_data.read_data(m_data_key, m_prefetch_offset, m_meta.byte_offset(m_meta.high_mark()) - m_prefetch_offset);
+}
+
+void ioremap::grape::chunk::prefetch_complete(const ioremap::elliptics::data_pointer &d, const ioremap::elliptics::error_info &error)
+{
+	m_prefetching = false;
+
+	if (error) {
+		// it will be read again when pop() wants it
+		LOG_ERROR("%s, prefetch, ERROR: %s", m_traceid.c_str(), error.message().c_str());
+		return;
+	}
+
+	// Cache could change while reading (grown by push, dropped,
+	// or rolled back by failed write), only the part which continues it is taken,
+	// and nothing beyond published entries is.
+	uint64_t end = std::min(m_prefetch_offset + d.size(), m_meta.byte_offset(m_meta.high_mark()));
+	if (m_data.size() >= m_prefetch_offset && end > m_data.size()) {
+		uint64_t skip = m_data.size() - m_prefetch_offset;
+		m_data.append((const char *)d.data() + skip, end - m_data.size());
+	}
+
+	LOG_INFO("%s, prefetch, read %ld bytes, m_data.size() %ld", m_traceid.c_str(), d.size(), m_data.size());
+}
+
 const ioremap::grape::chunk_meta &ioremap::grape::chunk::meta()
 {
 	return m_meta;
@@ -413,45 +1002,198 @@ const ioremap::grape::chunk_meta &ioremap::grape::chunk::meta()
 
 void ioremap::grape::chunk::remove()
 {
+	// nothing to append after removal
+	m_journal.clear();
+
+	// entries are gone along with the chunk (they are all acked or moved elsewhere)
+	std::vector<write_handler> handlers;
+	handlers.swap(m_unsynced);
+	for (const auto &handler : handlers) {
+		handler(ioremap::elliptics::error_info());
+	}
+
 	m_session_meta.remove(m_meta_key);
+	m_session_meta.remove(m_journal_key);
 	m_session_data.remove(m_data_key);
 	++m_stat.remove;
 }
 
-bool ioremap::grape::chunk::push(const ioremap::elliptics::data_pointer &d)
+ioremap::elliptics::async_write_result ioremap::grape::chunk::push(const ioremap::elliptics::data_pointer &d,
+		const std::vector<int> &sizes, const write_handler &handler, uint64_t *write_id,
+		const std::vector<uint32_t> &expires)
 {
-	LOG_INFO("%s, push-single, index %d, offset %ld", m_traceid.c_str(), m_meta.high_mark(), m_data.size());
+	LOG_INFO("%s, push, index %d, reserved %d, offset %ld, entries %ld", m_traceid.c_str(), m_meta.high_mark(), m_reserved, m_data.size(), sizes.size());
 
-	// if given chunk already has some cached data, update it too
-	if (m_data.size()) {
-		std::string tmp = m_data.to_string();
-		tmp += d.to_string();
+	if (rolling_back()) {
+		ioremap::elliptics::throw_error(-EAGAIN, "chunk is rolling back failed writes: reserved: %d, high: %d",
+				m_reserved, m_meta.high_mark());
+	}
+
+	if ((int)sizes.size() > capacity()) {
+		ioremap::elliptics::throw_error(-ERANGE, "chunk can not fit entries: entries: %ld, reserved: %d, max: %d",
+				sizes.size(), m_reserved, m_meta.max());
+	}
 
-		m_data = ioremap::elliptics::data_pointer::copy(tmp.data(), tmp.size());
+	// Keep cache in sync with the data object (fresh chunk's empty cache is in sync too),
+	// otherwise the tail will be read from the storage when needed.
+	uint64_t offset = m_reserved_bytes;
+	if (m_data.size() == offset) {
+		m_data.append((const char *)d.data(), d.size());
 	}
+	m_reserved_bytes += d.size();
 
-	LOG_INFO("%s, push-single, appending %s - %s", m_traceid.c_str(), dnet_dump_id_str(m_data_io.id), m_data_key.remote().c_str());
+	LOG_INFO("%s, push, writing %s - %s at offset %llu", m_traceid.c_str(), dnet_dump_id_str(m_data_io.id), m_data_key.remote().c_str(),
+			(unsigned long long)offset);
 
-	m_session_data.write_data(m_data_key, d, 0);
+	*write_id = m_next_write_id++;
+	m_writes.push_back(chunk_write{*write_id, offset, sizes, expires, handler, false, ioremap::elliptics::error_info()});
+	m_reserved += sizes.size();
+
+	// Whole batch goes to the storage as a single write at its own offset (not an append):
+	// writes in flight could complete in any order and still land where meta expects them
 	++m_stat.write_data;
-	//XXX: not going to wait for completion? what if write happen to be unsuccessfull?
+	return m_session_data.write_data(m_data_key, d, offset);
+}
+
+void ioremap::grape::chunk::push_complete(uint64_t write_id, const ioremap::elliptics::error_info &error)
+{
+	auto found = std::find_if(m_writes.begin(), m_writes.end(),
+			[write_id] (const chunk_write &w) { return w.id == write_id; });
+	if (found == m_writes.end()) {
+		LOG_ERROR("%s, push complete, write %ld is unknown", m_traceid.c_str(), write_id);
+		return;
+	}
+
+	found->done = true;
+	found->error = error;
+
+	// Writes to the same object could complete out of order,
+	// but entries must be published to meta strictly in push order.
+	// Producers are replied once their entries' records are written
+	// (with the journal append or the whole meta which is issued below).
+	std::deque<chunk_write> completed;
+	while (!m_writes.empty() && m_writes.front().done && !m_writes.front().error) {
+		if (m_writes.front().handler) {
+			m_unsynced.push_back(m_writes.front().handler);
+		}
+		completed.push_back(std::move(m_writes.front()));
+		m_writes.pop_front();
+	}
+
+	for (const auto &w : completed) {
+		for (size_t i = 0; i < w.sizes.size(); ++i) {
+			uint32_t expire = w.expires.empty() ? 0 : w.expires[i];
+			int32_t pos = m_meta.high_mark();
+
+			journal(chunk_journal_record::PUSH, pos, w.sizes[i]);
+			if (expire) {
+				journal(chunk_journal_record::EXPIRE, pos, (int32_t)expire);
+			}
+			m_meta.push(w.sizes[i], expire);
+		}
+		m_stat.push += w.sizes.size();
+	}
+
+	// Entries after the failed write could not be published without it,
+	// so the failed write and every one issued after it are rolled back,
+	// but only once none of them is in flight: a late write must not land
+	// over entries which are pushed anew at the same offsets.
+	// Chunk takes no pushes meanwhile (see rolling_back()).
+	std::deque<chunk_write> failed;
+	if (!m_writes.empty() && m_writes.front().error &&
+			std::all_of(m_writes.begin(), m_writes.end(), [] (const chunk_write &w) { return w.done; })) {
+		LOG_ERROR("%s, push complete, ERROR: write failed: %s, rolling back %ld writes to high mark %d (reserved %d)",
+				m_traceid.c_str(), m_writes.front().error.message().c_str(), m_writes.size(), m_meta.high_mark(), m_reserved);
+
+		failed.swap(m_writes);
+		m_reserved = m_meta.high_mark();
+		m_reserved_bytes = m_meta.byte_offset(m_reserved);
+		if (m_data.size() > m_reserved_bytes) {
+			m_data.resize(m_reserved_bytes);
+		}
+	}
+
+	bool sealed = !failed.empty() && m_closed && !m_meta.full();
+	if (sealed) {
+		// nothing is pushed to fill the room of the failed writes anymore
+		LOG_ERROR("%s, push complete, chunk is closed, sealing it at high mark %d", m_traceid.c_str(), m_meta.high_mark());
+		m_meta.seal();
+	}
 
-	m_meta.push(d.size());
-	if (m_meta.full()) {
-		//XXX: is it good to write meta only for full chunks?
+	if ((!completed.empty() || sealed) && m_meta.full()) {
+		// whole meta is written once chunk is filled,
+		// journal records are not needed anymore, unless a fold is in flight:
+		// its older base meta could land after this one
+		if (!m_folding) {
+			m_journal.clear();
+		}
 		write_meta();
+	} else {
+		// folding is left for the ack path
+		write_journal();
 	}
 
-	++m_stat.push;
-	return m_meta.full();
+	if (!failed.empty()) {
+		ioremap::elliptics::error_info first_error = failed.front().error;
+		for (const auto &w : failed) {
+			if (w.handler) {
+				w.handler(w.error ? w.error : first_error);
+			}
+		}
+	}
+}
+
+int ioremap::grape::chunk::capacity() const
+{
+	return m_meta.max() - m_reserved;
+}
+
+bool ioremap::grape::chunk::full() const
+{
+	return capacity() <= 0;
+}
+
+const std::vector<int32_t> &ioremap::grape::chunk::expired() const
+{
+	return m_expired;
+}
+
+bool ioremap::grape::chunk::pushing() const
+{
+	return !m_writes.empty();
+}
+
+bool ioremap::grape::chunk::rolling_back() const
+{
+	return std::any_of(m_writes.begin(), m_writes.end(), [] (const chunk_write &w) { return w.error; });
+}
+
+void ioremap::grape::chunk::close()
+{
+	m_closed = true;
+
+	// with writes in flight it is left to push_complete()
+	if (!m_writes.empty() || m_meta.full()) {
+		return;
+	}
+
+	LOG_ERROR("%s, close, sealing chunk at high mark %d (max %d)", m_traceid.c_str(), m_meta.high_mark(), m_meta.max());
+	m_meta.seal();
+	m_reserved = m_meta.high_mark();
+	m_reserved_bytes = m_meta.byte_offset(m_reserved);
+	if (!m_folding) {
+		m_journal.clear();
+	}
+	write_meta();
 }
 
 bool ioremap::grape::chunk::ack(int pos, bool write)
 {
 	//FIXME: check if pos < low < high
 	m_meta.ack(pos, chunk_entry::STATE_ACKED);
+	journal(chunk_journal_record::ACK, pos, 0);
 	if (write) {
-		write_meta();
+		write_journal();
 	}
 
 	++m_stat.ack;
@@ -459,6 +1201,25 @@ bool ioremap::grape::chunk::ack(int pos, bool write)
 	return m_meta.complete();
 }
 
+int ioremap::grape::chunk::redelivered(int32_t pos)
+{
+	int attempts = m_meta.redelivered(pos);
+	journal(chunk_journal_record::ATTEMPT, pos, attempts - 1);
+	return attempts;
+}
+
+int ioremap::grape::chunk::ack_range(int32_t from, int32_t to)
+{
+	int count = m_meta.ack_range(from, to);
+	if (count) {
+		journal(chunk_journal_record::ACK_RANGE, from, to);
+	}
+
+	m_stat.ack += count;
+
+	return count;
+}
+
 void ioremap::grape::chunk::reset_iteration()
 {
 	iteration_state = iteration();
@@ -485,6 +1246,7 @@ void ioremap::grape::chunk::add(struct ioremap::grape::chunk_stat *st)
 #define SUM(member)	st->member += m_stat.member
 	SUM(write_data);
 	SUM(write_meta);
+	SUM(write_journal);
 	SUM(read);
 	SUM(remove);
 	SUM(push);
@@ -498,13 +1260,3 @@ int ioremap::grape::chunk::id(void) const
 	return m_chunk_id;
 }
 
-void ioremap::grape::chunk::reset_time(uint64_t timeout)
-{
-	uint64_t now = microseconds_now();
-	m_fire_time = now + timeout;
-}
-
-uint64_t ioremap::grape::chunk::get_time(void)
-{
-	return m_fire_time;
-}
@@ -2,6 +2,9 @@
 #define __CHUNK_HPP
 
 #include <memory>
+#include <deque>
+#include <unordered_map>
+#include <functional>
 
 #include <elliptics/session.hpp>
 #include <cocaine/framework/logging.hpp>
@@ -24,6 +27,23 @@ struct chunk_entry {
 	int state;
 };
 
+// Record of the chunk's append-only journal.
+// Records are idempotent: replaying one over the meta which already
+// includes it changes nothing, so journal could be replayed in full
+// over any (older or newer) base meta.
+struct chunk_journal_record {
+	static const int32_t PUSH = 1; // entry @pos of @size is pushed
+	static const int32_t ACK = 2;  // entry @pos is popped and acked
+	static const int32_t ACK_RANGE = 3; // entries from @pos to @size (inclusive) are popped and acked
+	static const int32_t EXPIRE = 4; // entry @pos expires at @size (seconds since epoch, unsigned)
+	static const int32_t ATTEMPT = 5; // entry @pos is redelivered @size times so far
+
+	int32_t type;
+	int32_t pos;
+	int32_t size;
+};
+
+// Legacy meta layout: entry record is preallocated for every possible entry
 struct chunk_disk {
 	int max;  // size
 	int low;  // indicies: low/high marks
@@ -32,24 +52,59 @@ struct chunk_disk {
 	struct chunk_entry entries[];
 };
 
+// Compact meta layout, header is followed by:
+//  * sizes of @high entries, @size_width bytes each
+//  * ack bitmap of @high bits (rounded up to the byte)
+//  * (version 3 and 4) expiry times of @high entries, 4 bytes each
+//  * (version 4 only) number of redelivered entries, 4 bytes, followed by
+//    position and redelivery count of every such entry, 4 bytes each
+// Version 3 is written only for chunks with expiring entries,
+// version 4 only for chunks with redelivered entries which are not acked.
+struct chunk_disk_header {
+	static const uint32_t MAGIC = 0x4d435247; // "GRCM"
+	static const uint16_t VERSION = 2;
+	static const uint16_t VERSION_EXPIRES = 3;
+	static const uint16_t VERSION_ATTEMPTS = 4;
+
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size_width; // 1, 2 or 4 bytes, just enough for the biggest entry
+	int32_t max;
+	int32_t low;
+	int32_t high;
+	int32_t acked;
+} __attribute__ ((packed));
+
 class chunk_meta {
 	public:
 		ELLIPTICS_DISABLE_COPY(chunk_meta);
 
 		chunk_meta(int max);
 
-		// Increases high mark.
+		// Increases high mark, entry expires at @expire (seconds since epoch, 0 is never).
 		// Returns true when given chunk is full
-		bool push(int size);
+		bool push(int size, uint32_t expire = 0);
 		// Increases low mark
 		void pop();
 		// Marks entry at @pos position with @state state.
 		// Returns true when given chunk is fully acked
 		bool ack(int32_t pos, int state);
-
+		// Acks entries from @from to @to (inclusive) in bulk,
+		// returns number of entries which were not acked before
+		int ack_range(int32_t from, int32_t to);
+		// Shrinks maximum to the high mark, so no more entries
+		// could be pushed and chunk could be completed with entries it has
+		void seal();
+		// Applies journal record over the meta.
+		// Returns false if record does not fit the meta
+		bool replay(const chunk_journal_record &record);
+
+		// Serializes meta in compact layout
 		std::string &data();
+		// Accepts both compact and legacy layouts
 		void assign(char *data, size_t size);
 
+		int max() const;
 		int low_mark() const;
 		int high_mark() const;
 		int acked() const;
@@ -61,9 +116,50 @@ class chunk_meta {
 		chunk_entry operator[] (int32_t pos) const;
 		uint64_t byte_offset(int32_t pos) const;
 
+		// Delivery attempts of the entry. Only redeliveries are counted (first
+		// delivery is attempt 1), counts of entries which are not acked
+		// are kept in meta (and journaled by the chunk with ATTEMPT records).
+		// redelivered() counts one more attempt and returns attempts so far.
+		int redelivered(int32_t pos);
+		int attempts(int32_t pos) const;
+
+		// true if any entry of the chunk has expiry time
+		bool expiring() const;
+		// expiry time of the entry (seconds since epoch, 0 is never)
+		uint32_t expire(int32_t pos) const;
+		bool expired(int32_t pos, uint32_t now) const;
+		// every entry of the full chunk is expired by @now
+		bool expired(uint32_t now) const;
+
 	private:
+		int m_max;
+		int m_low;
+		int m_high;
+		int m_acked;
+
+		// both grow with pushes, only entries below high mark are kept
+		std::vector<int> m_sizes;
+		std::vector<bool> m_acked_map;
+		// in-memory prefix sums of entry sizes: byte offset of every entry
+		// plus the total size at the end (has high + 1 items)
+		std::vector<uint64_t> m_offsets;
+
+		// redelivery counts of entries which were redelivered and are not acked yet
+		std::unordered_map<int32_t, int> m_redelivered;
+
+		// expiry times of entries, empty if none of them expires
+		std::vector<uint32_t> m_expires;
+		// expiry time of the whole chunk (0 is never), found once the chunk is full
+		// and forgotten whenever expiry times change
+		mutable bool m_expire_known;
+		mutable uint32_t m_expire_all;
+
+		// serialization buffer
 		std::string m_data;
-		struct chunk_disk *m_ptr;
+
+		void rebuild_offsets(int from);
+		void assign_legacy(char *data, size_t size);
+		void assign_compact(char *data, size_t size);
 };
 
 struct iteration {
@@ -149,6 +245,7 @@ struct replay_iterator : public iterator {
 struct chunk_stat {
 	uint64_t write_data;
 	uint64_t write_meta;
+	uint64_t write_journal;
 	uint64_t read;
 	uint64_t remove;
 	uint64_t push;
@@ -156,24 +253,120 @@ struct chunk_stat {
 	uint64_t ack;
 };
 
+// Write of entries to the chunk's data object which is in flight
+struct chunk_write {
+	uint64_t id;
+	// offset in the data object the entries are written at
+	uint64_t offset;
+	std::vector<int> sizes;
+	std::vector<uint32_t> expires;
+	std::function<void (const elliptics::error_info &)> handler;
+	bool done;
+	elliptics::error_info error;
+};
+
 class chunk {
 	public:
 		ELLIPTICS_DISABLE_COPY(chunk);
 
-		chunk(elliptics::session &session, const std::string &queue_id, int chunk_id, int max);
+		typedef std::function<void (const elliptics::error_info &)> write_handler;
+
+		chunk(elliptics::session &session, const std::string &queue_id, int chunk_id, int max, int journal_max);
 		~chunk();
 
+		// Reads base meta and replays journal over it,
+		// returns false if chunk has no meta at all
 		bool load_meta();
+		// Asynchronous loading: base meta and journal are read in parallel
+		// and then passed to load_complete() (which could throw just as load_meta())
+		elliptics::async_read_result read_meta();
+		elliptics::async_read_result read_journal();
+		bool load_complete(const elliptics::data_pointer &meta, const elliptics::error_info &meta_error,
+				const elliptics::data_pointer &journal, const elliptics::error_info &journal_error);
+		// Meta is in memory: it is loaded, or chunk is created anew (see set_loaded())
+		bool loaded() const;
+		void set_loaded();
+		// Writes whole meta, journal is not touched
 		void write_meta();
+		// Appends pending journal records (they are held while journal is being folded)
+		void write_journal();
+		// Journal grows over its limit and should be folded into the base meta:
+		// fold_journal() writes the base meta, its result goes to fold_written(),
+		// which tells if the journal is to be removed with remove_journal(),
+		// and the removal result goes to fold_complete().
+		bool fold_needed() const;
+		elliptics::async_write_result fold_journal();
+		bool fold_written(const elliptics::error_info &error);
+		elliptics::async_remove_result remove_journal();
+		void fold_complete(const elliptics::error_info &error);
 		const chunk_meta &meta();
 
-		// single entry methods
-		bool push(const elliptics::data_pointer &d); // returns true if chunk is full
-		elliptics::data_pointer pop(int32_t *pos);
 		bool ack(int32_t pos, bool write);
-
-		// multiple entries methods
-		data_array pop(int num);
+		// counts one more delivery attempt of the entry (see chunk_meta::redelivered())
+		// and journals it, caller is to write the journal
+		int redelivered(int32_t pos);
+		// acks entries from @from to @to (inclusive) with a single journal record,
+		// returns number of entries which were not acked before
+		int ack_range(int32_t from, int32_t to);
+
+		// Pops entries which are in the data cache, never waits for the storage:
+		// if next entry is not cached yet, data_wanted() tells so
+		// and caller should bring it with prefetch().
+		// Popped entries take no more than @max_bytes (0 is no limit),
+		// budget_reached() tells if pop stopped at the entry which does not fit.
+		// Expired entries are popped but not given out, expired() lists them
+		// and caller is to ack them.
+		// Entries which were popped before the restart (and are not acked) are popped
+		// again as redelivered, and their attempts are journaled.
+		data_array pop(int num, uint64_t max_bytes = 0);
+		bool data_wanted() const;
+		bool budget_reached() const;
+		const std::vector<int32_t> &expired() const;
+
+		// Reads entry at @pos from the data cache regardless of the iteration (to redeliver it),
+		// returns false if it is not cached
+		bool read(int32_t pos, elliptics::data_pointer *d);
+
+		// size of the data cache, and dropping it (it will be read again when needed)
+		uint64_t cached_bytes() const;
+		void drop_cache();
+
+		// True if published entries are not all in the data cache
+		// and no read is in flight
+		bool need_prefetch() const;
+		// Starts reading the part of the data object beyond the cache,
+		// caller must pass the read data to prefetch_complete()
+		elliptics::async_read_result prefetch();
+		void prefetch_complete(const elliptics::data_pointer &d, const elliptics::error_info &error);
+
+		// Issues write of entries @d (of given @sizes and @expires, which could be empty
+		// if entries never expire) to the chunk's data object at the offset reserved for them,
+		// so writes in flight could land in any order.
+		// Entries are not visible to pop() until the write completes,
+		// caller must pass the write's result to push_complete() with returned @write_id.
+		// @handler is called once the entries are durable: their data is written
+		// and so are their journal records (or the whole meta), it gets the error
+		// of either write. Handler could be called from the storage thread.
+		elliptics::async_write_result push(const elliptics::data_pointer &d, const std::vector<int> &sizes,
+				const write_handler &handler, uint64_t *write_id,
+				const std::vector<uint32_t> &expires = std::vector<uint32_t>());
+		// Publishes completed writes into meta. Failed write is rolled back
+		// (along with every write issued after it) as soon as none of them is in flight,
+		// their handlers get the error and their room in the chunk is free again.
+		void push_complete(uint64_t write_id, const elliptics::error_info &error);
+
+		// number of entries which still could be pushed (including writes in flight)
+		int capacity() const;
+		bool full() const;
+		// writes are in flight, their entries are not in meta yet
+		bool pushing() const;
+		// a write failed and chunk waits for writes issued after it to roll them back,
+		// push() is not allowed meanwhile
+		bool rolling_back() const;
+		// Queue has moved on to the next chunk, no more entries are pushed here.
+		// Room which is left unfilled (by rolled back writes or lost with a crash)
+		// is sealed off, and the meta is written, so readers see the chunk complete.
+		void close();
 
 		void reset_iteration();
 		bool expect_no_more();
@@ -184,8 +377,6 @@ class chunk {
 		void add(struct chunk_stat *st);
 
 		int id() const;
-		void reset_time(uint64_t timeout);
-		uint64_t get_time(void);
 
 	private:
 		std::string m_traceid;
@@ -194,24 +385,66 @@ class chunk {
 		dnet_io_attr m_data_io;
 		elliptics::key m_meta_key;
 		dnet_io_attr m_meta_io;
+		elliptics::key m_journal_key;
+		// data is written at reserved offsets, journal is appended to
 		elliptics::session m_session_data;
 		elliptics::session m_session_meta;
+		elliptics::session m_session_journal;
 
 		struct chunk_stat m_stat;
 
 		iteration iteration_state;
 		std::unique_ptr<iterator> iter;
 
-		// whole chunk data is cached here
-		// cache is being filled when ::pop is invoked and @m_pop_offset is >= than cache size
-		elliptics::data_pointer m_data;
+		// Chunk data is cached here, cache is a prefix of the data object.
+		// Its missing tail (up to published entries) is read from the storage by ::prefetch
+		// (when ::pop wants it), and ::push appends to it in place while it ends
+		// at the reserved offset, so entries pushed by this worker are never read back.
+		// Cache could run ahead of the published entries, but never ahead of what is written
+		// to the storage or is being written there.
+		std::string m_data;
+		// offset of the read-ahead in flight
+		uint64_t m_prefetch_offset;
+		bool m_prefetching;
 
 		chunk_meta m_meta;
 
-		double m_fire_time;
+		// writes in flight, in push order
+		std::deque<chunk_write> m_writes;
+		uint64_t m_next_write_id;
+		// high mark including writes in flight
+		int m_reserved;
+		// size of the data object including writes in flight,
+		// every write goes at the offset reserved for it
+		uint64_t m_reserved_bytes;
+		bool m_closed;
+
+		// handlers of published writes which wait for their records to be written,
+		// sync_writes() hands them over to the journal append or meta write
+		std::vector<write_handler> m_unsynced;
+		void sync_writes(elliptics::async_write_result &result);
+
+		// records not yet appended to the journal
+		std::vector<chunk_journal_record> m_journal;
+		// records in the journal object since last fold
+		int m_journal_records;
+		int m_journal_max;
+		// fold is in flight, records wait in m_journal,
+		// m_folded ones are those which are being written with the base meta
+		bool m_folding;
+		std::vector<chunk_journal_record> m_folded;
+
+		void journal(int32_t type, int32_t pos, int32_t size);
+		bool apply_journal(const elliptics::data_pointer &d);
+		bool m_loaded;
 
 		void reset_iteration_mode();
-		bool update_data_cache();
+		// pop() stopped at the entry not in the data cache
+		bool m_data_wanted;
+		// pop() stopped at the entry which does not fit into its byte budget
+		bool m_budget_reached;
+		// entries which pop() found expired
+		std::vector<int32_t> m_expired;
 };
 
 typedef std::shared_ptr<chunk> shared_chunk;
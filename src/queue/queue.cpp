@@ -1,4 +1,6 @@
 #include <unordered_set>
+#include <algorithm>
+#include <numeric>
 
 #include <cocaine/framework/logging.hpp>
 
@@ -34,20 +36,133 @@ std::shared_ptr<cocaine::framework::logger_t> grape_queue_module_get_logger() {
 
 namespace ioremap { namespace grape {
 
+namespace {
+	uint64_t entry_key(const entry_id &id) {
+		return ((uint64_t)(uint32_t)id.chunk << 32) | (uint32_t)id.pos;
+	}
+
+	int lane_of(int chunk_id) {
+		return chunk_id / queue_lane::LANE_CHUNKS;
+	}
+
+	int lane_base(int lane) {
+		return lane * queue_lane::LANE_CHUNKS;
+	}
+
+	// Base name of the app the queue is run as, events are sent to it:
+	// worker's id is the app name with the worker's number appended ("queue-1")
+	std::string app_name(const std::string &queue_id) {
+		size_t dash = queue_id.find_last_of('-');
+		if (dash == std::string::npos || dash == 0 || dash + 1 == queue_id.size() ||
+				queue_id.find_first_not_of("0123456789", dash + 1) != std::string::npos) {
+			return queue_id;
+		}
+		return queue_id.substr(0, dash);
+	}
+
+	// delivery times of delayed entries survive restarts, so they go by the wall clock
+	int64_t milliseconds_since_epoch() {
+		timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+	}
+}
+
 namespace defaults {
 	const int MAX_CHUNK_SIZE = 10000;
+	const int WAIT_TIMEOUT = 5; // seconds, the storage client's own default
 	const uint64_t ACK_WAIT_TIMEOUT = 5 * 1000000; // microseconds
-	const uint64_t TIMEOUT_CHECK_PERIOD = 1 * 1000000; // microseconds
+	const uint64_t TIMEOUT_TICK = 10 * 1000; // microseconds
+	const uint64_t PUSH_LINGER_TIME = 0; // microseconds, 0 - pushes are not grouped
+	const uint64_t PUSH_LINGER_BYTES = 1024 * 1024;
+	const int PUSH_INFLIGHT_MAX = 64;
+	const int JOURNAL_MAX_RECORDS = 1000;
+	const int READ_AHEAD_ENTRIES = 1000;
+	const uint64_t CACHE_MAX_BYTES = 0; // 0 - unlimited
+	const int LOAD_PARALLEL = 8;
+	const int MAX_DELIVERIES = 0; // 0 - entries are redelivered forever
+	const char DEAD_LETTER_QUEUE_SUFFIX[] = ".dlq"; // appended to the queue's app name
+	const bool SKIP_MISSING_CHUNKS = false;
+	const int LOAD_ATTEMPTS = 3; // chunk which fails to load that many times is skipped (with skip-missing-chunks)
+	const int PRIORITY_LANES = 1;
+	const int64_t DELAY_BUCKET = 1000; // milliseconds
+	const int TTL = 0; // seconds, 0 - entries never expire
 }
 
 queue::queue(const std::string &queue_id)
 	: m_chunk_max(defaults::MAX_CHUNK_SIZE)
+	, m_wait_timeout(defaults::WAIT_TIMEOUT)
 	, m_ack_wait_timeout(defaults::ACK_WAIT_TIMEOUT)
-	, m_timeout_check_period(defaults::TIMEOUT_CHECK_PERIOD)
+	, m_timeout_tick(defaults::TIMEOUT_TICK)
+	, m_push_linger_time(defaults::PUSH_LINGER_TIME)
+	, m_push_linger_bytes(defaults::PUSH_LINGER_BYTES)
+	, m_push_inflight_max(defaults::PUSH_INFLIGHT_MAX)
+	, m_journal_max(defaults::JOURNAL_MAX_RECORDS)
+	, m_read_ahead(defaults::READ_AHEAD_ENTRIES)
+	, m_cache_max(defaults::CACHE_MAX_BYTES)
+	, m_load_parallel(defaults::LOAD_PARALLEL)
+	, m_max_deliveries(defaults::MAX_DELIVERIES)
+	, m_dead_letter_queue(app_name(queue_id) + defaults::DEAD_LETTER_QUEUE_SUFFIX)
+	, m_skip_missing_chunks(defaults::SKIP_MISSING_CHUNKS)
+	, m_delay_bucket(defaults::DELAY_BUCKET)
+	, m_ttl(defaults::TTL)
 	, m_queue_id(queue_id)
 	, m_queue_state_id(m_queue_id + ".state")
-	, m_last_timeout_check_time(0)
+	, m_lanes_weighted(false)
+	, m_push_inflight(0)
+	, m_io_inflight(0)
+	, m_delayed_id(m_queue_id + ".delayed")
+	, m_delayed_state_id(m_delayed_id + ".state")
+	, m_delayed_chunk_next(0)
+	, m_cache_bytes(0)
+	, m_timer_wakeup(0)
+	, m_timer_stop(false)
+{
+}
+
+queue::~queue()
 {
+	{
+		auto guard = lock();
+		if (m_data_client) {
+			flush_pushes();
+		}
+
+		m_load_line.clear();
+		// peeks left are never replied, clients will time out
+		m_peek_waiting.clear();
+
+		// Completion handlers of the storage operations in flight refer to the queue.
+		// They are waited for no longer than the storage timeout: after that pushes
+		// still waiting for a write slot are failed, and operations already issued
+		// get the same time to be timed out by the storage.
+		auto busy = [this] () {
+			return m_push_inflight > 0 || !m_push_backlog.empty() || m_io_inflight > 0 || !m_loading.empty();
+		};
+		for (int round = 0; round < 2 && busy(); ++round) {
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(m_wait_timeout);
+			while (busy() && m_timer_condition.wait_until(guard, deadline) != std::cv_status::timeout) {
+			}
+
+			if (busy()) {
+				LOG_ERROR("%s, exit: storage operations are not completed in %d seconds: %d pushes, %ld batches waiting, %d reads",
+						m_queue_id.c_str(), m_wait_timeout, m_push_inflight, m_push_backlog.size(), m_io_inflight + (int)m_loading.size());
+				fail_push_backlog(ioremap::elliptics::error_info(-ETIMEDOUT, "queue is stopped before the push is written"));
+			}
+		}
+
+		m_timer_stop = true;
+		m_timer_condition.notify_all();
+	}
+
+	if (m_timer_thread.joinable()) {
+		m_timer_thread.join();
+	}
+}
+
+std::unique_lock<std::recursive_mutex> queue::lock()
+{
+	return std::unique_lock<std::recursive_mutex>(m_mutex);
 }
 
 void queue::initialize(const std::string &config)
@@ -68,9 +183,9 @@ void queue::initialize(const std::string &config)
 	}
 
 	if (doc.HasMember("wait-timeout")) {
-		int timeout = doc["wait-timeout"].GetInt();
-		m_reply_client->set_timeout(timeout);
-		m_data_client->set_timeout(timeout);
+		m_wait_timeout = doc["wait-timeout"].GetInt();
+		m_reply_client->set_timeout(m_wait_timeout);
+		m_data_client->set_timeout(m_wait_timeout);
 	}
 
 	LOG_INFO("%s, init: elliptics client created", m_queue_id.c_str());
@@ -84,46 +199,216 @@ void queue::initialize(const std::string &config)
 		m_ack_wait_timeout = 1000000 * doc["ack-wait-timeout"].GetInt();
 	}
 
-	if (doc.HasMember("timeout-check-period")) {
-		// config value in seconds
-		m_timeout_check_period = 1000000 * doc["timeout-check-period"].GetInt();
+	if (doc.HasMember("timeout-tick-ms")) {
+		// config value in milliseconds
+		m_timeout_tick = 1000 * std::max(1, doc["timeout-tick-ms"].GetInt());
+	} else if (doc.HasMember("timeout-check-period")) {
+		// obsolete key, config value in seconds
+		m_timeout_tick = 1000000 * std::max(1, doc["timeout-check-period"].GetInt());
+		LOG_ERROR("%s, init: 'timeout-check-period' is obsolete, use 'timeout-tick-ms' instead, tick is set to %lld ms",
+				m_queue_id.c_str(), (long long)(m_timeout_tick / 1000));
 	}
+	m_timeouts.reset(new timer_wheel<entry_id>(m_timeout_tick));
+	m_delay_timers.reset(new timer_wheel<int>(m_timeout_tick));
 
-	memset(&m_state, 0, sizeof(m_state));
+	if (doc.HasMember("push-linger-us")) {
+		// config value in microseconds
+		m_push_linger_time = doc["push-linger-us"].GetUint64();
+	}
 
-	try {
-		ioremap::elliptics::data_pointer d = m_data_client->read_data(m_queue_state_id, 0, 0).get_one().file();
-		auto *state = d.data<queue_state>();
+	if (doc.HasMember("push-linger-bytes")) {
+		m_push_linger_bytes = doc["push-linger-bytes"].GetUint64();
+	}
 
-		m_state.chunk_id_push = state->chunk_id_push;
-		m_state.chunk_id_ack = state->chunk_id_ack;
+	if (doc.HasMember("push-inflight-max")) {
+		m_push_inflight_max = std::max(1, doc["push-inflight-max"].GetInt());
+	}
 
-		LOG_INFO("%s, init: queue meta found: chunk_id_ack %d, chunk_id_push %d",
-				m_queue_id.c_str(),
-				m_state.chunk_id_ack, m_state.chunk_id_push
-				);
+	if (doc.HasMember("journal-max-records")) {
+		m_journal_max = doc["journal-max-records"].GetInt();
+	}
 
-	} catch (const ioremap::elliptics::not_found_error &) {
-		LOG_INFO("%s, init: no queue meta found, starting in pristine state", m_queue_id.c_str());
+	if (doc.HasMember("read-ahead-entries")) {
+		m_read_ahead = doc["read-ahead-entries"].GetInt();
+	}
+
+	if (doc.HasMember("cache-max-bytes")) {
+		m_cache_max = doc["cache-max-bytes"].GetUint64();
+	}
+
+	if (doc.HasMember("chunk-load-parallel")) {
+		m_load_parallel = std::max(1, doc["chunk-load-parallel"].GetInt());
+	}
+
+	if (doc.HasMember("max-deliveries")) {
+		m_max_deliveries = std::max(0, doc["max-deliveries"].GetInt());
+	}
+
+	if (doc.HasMember("dead-letter-queue")) {
+		m_dead_letter_queue = doc["dead-letter-queue"].GetString();
+	}
+
+	if (doc.HasMember("skip-missing-chunks")) {
+		m_skip_missing_chunks = doc["skip-missing-chunks"].GetBool();
+	}
+
+	if (doc.HasMember("delay-bucket-ms")) {
+		m_delay_bucket = std::max(1, doc["delay-bucket-ms"].GetInt());
+	}
+
+	if (doc.HasMember("ttl-seconds")) {
+		m_ttl = std::max(0, doc["ttl-seconds"].GetInt());
+	}
+
+	int lanes = defaults::PRIORITY_LANES;
+	if (doc.HasMember("priority-lanes")) {
+		lanes = std::max(1, doc["priority-lanes"].GetInt());
+	}
+	if (lanes > queue_lane::MAX_LANES) {
+		throw configuration_error("priority-lanes must be at most " + std::to_string(queue_lane::MAX_LANES));
+	}
+
+	std::vector<int> weights;
+	read_groups_array(&weights, "lane-weights", doc);
+	if (!weights.empty() && (int)weights.size() != lanes) {
+		throw configuration_error("lane-weights must have a weight for every one of priority-lanes");
+	}
+	m_lanes_weighted = std::accumulate(weights.begin(), weights.end(), 0) > 0;
+
+	m_lanes.resize(lanes);
+	for (int lane = 0; lane < lanes; ++lane) {
+		queue_lane &l = m_lanes[lane];
+
+		// lane 0 keeps the state object of the queue without lanes
+		l.state_id = lane ? m_queue_state_id + "." + std::to_string(lane) : m_queue_state_id;
+		l.state.chunk_id_push = lane_base(lane);
+		l.state.chunk_id_ack = lane_base(lane);
+		l.weight = weights.empty() ? 1 : std::max(0, weights[lane]);
+		l.score = 0;
+		l.missing_chunk = -1;
+
+		try {
+			ioremap::elliptics::data_pointer d = m_data_client->read_data(l.state_id, 0, 0).get_one().file();
+			auto *state = d.data<queue_state>();
+
+			l.state.chunk_id_push = state->chunk_id_push;
+			l.state.chunk_id_ack = state->chunk_id_ack;
+
+			// queue which ran without lanes long enough has chunk ids of lane 1 and on
+			if (lane_of(l.state.chunk_id_ack) != lane || lane_of(l.state.chunk_id_push) != lane ||
+					l.state.chunk_id_ack > l.state.chunk_id_push) {
+				ioremap::elliptics::throw_error(-ERANGE, "%s: lane %d state is out of the lane's chunk id range: "
+						"chunk_id_ack %d, chunk_id_push %d, lane chunks %d",
+						m_queue_id.c_str(), lane, l.state.chunk_id_ack, l.state.chunk_id_push, queue_lane::LANE_CHUNKS);
+			}
+
+			LOG_INFO("%s, init: lane %d, queue meta found: chunk_id_ack %d, chunk_id_push %d",
+					m_queue_id.c_str(), lane,
+					l.state.chunk_id_ack, l.state.chunk_id_push
+					);
+
+		} catch (const ioremap::elliptics::not_found_error &) {
+			LOG_INFO("%s, init: lane %d, no queue meta found, starting in pristine state", m_queue_id.c_str(), lane);
+		}
+
+		// Only push chunk's metadata is loaded right away, so that pushes are served at once.
+		// Other existing chunks are loaded in background in pop order
+		// (or by peek itself if it gets to the chunk first).
+		for (int i = l.state.chunk_id_ack; i <= l.state.chunk_id_push; ++i) {
+			auto p = std::make_shared<chunk>(*m_data_client.get(), m_queue_id, i, m_chunk_max, m_journal_max);
+			m_chunks.insert(std::make_pair(i, p));
+			if (i == l.state.chunk_id_push) {
+				p->load_meta();
+			} else {
+				m_load_line.push_back(p);
+			}
+		}
 	}
 
-	// load metadata of existing chunk into memory
-	for (int i = m_state.chunk_id_ack; i <= m_state.chunk_id_push; ++i) {
-		auto p = std::make_shared<chunk>(*m_data_client.get(), m_queue_id, i, m_chunk_max);
-		m_chunks.insert(std::make_pair(i, p));
-		if (!p->load_meta() && i < m_state.chunk_id_push) {
-			LOG_ERROR("%s, init: failed to read middle chunk meta data, can't proceed, exiting", m_queue_id.c_str());
-			ioremap::elliptics::throw_error(-ENODATA, "middle chunk %d meta data is missing", i);
+	try {
+		ioremap::elliptics::data_pointer d = m_data_client->read_data(m_delayed_state_id, 0, 0).get_one().file();
+		auto state = deserialize<delayed_state>(d);
+
+		m_delayed_chunk_next = state.chunk_id_next;
+		uint64_t now = microseconds_now();
+		for (const auto &record : state.chunks) {
+			m_delayed[record.chunk_id] = record;
+			schedule_promotion(record, now);
 		}
+
+		LOG_INFO("%s, init: %ld delayed chunks found", m_queue_id.c_str(), m_delayed.size());
+
+	} catch (const ioremap::elliptics::not_found_error &) {
+		LOG_INFO("%s, init: no delayed chunks found", m_queue_id.c_str());
 	}
 
+	LOG_INFO("%s, init: %ld chunks to be loaded in background", m_queue_id.c_str(), m_load_line.size());
+	load_chunks();
+
+	m_timer_thread = std::thread(std::bind(&queue::timer_loop, this));
+
 	LOG_INFO("%s, init: queue started", m_queue_id.c_str());
 }
 
-void queue::write_state()
+void queue::schedule(uint64_t time)
+{
+	if (m_timer_wakeup == 0 || time < m_timer_wakeup) {
+		m_timer_wakeup = time;
+		m_timer_condition.notify_all();
+	}
+}
+
+void queue::timer_loop()
+{
+	auto guard = lock();
+
+	while (!m_timer_stop) {
+		if (m_timer_wakeup == 0) {
+			m_timer_condition.wait(guard);
+			continue;
+		}
+
+		uint64_t now = microseconds_now();
+		if (now < m_timer_wakeup) {
+			m_timer_condition.wait_for(guard, std::chrono::microseconds(m_timer_wakeup - now));
+			continue;
+		}
+
+		m_timer_wakeup = 0;
+		on_timer(now);
+	}
+}
+
+void queue::on_timer(uint64_t now)
+{
+	for (int lane = 0; lane < (int)m_lanes.size(); ++lane) {
+		uint64_t deadline = m_lanes[lane].group.deadline;
+		if (deadline) {
+			if (now >= deadline) {
+				flush_pushes(lane);
+			} else {
+				schedule(deadline);
+			}
+		}
+	}
+
+	if (!m_timeouts->empty()) {
+		expire_timeouts(now);
+	}
+
+	if (!m_peek_waiting.empty()) {
+		expire_peeks(now);
+	}
+
+	if (!m_delay_timers->empty()) {
+		expire_delays(now);
+	}
+}
+
+void queue::write_state(int lane)
 {
-	m_data_client->write_data(m_queue_state_id,
-			ioremap::elliptics::data_pointer::from_raw(&m_state, sizeof(queue_state)),
+	m_data_client->write_data(m_lanes[lane].state_id,
+			ioremap::elliptics::data_pointer::from_raw(&m_lanes[lane].state, sizeof(queue_state)),
 			0);
 
 	m_statistics.state_write_count++;
@@ -133,20 +418,54 @@ void queue::clear()
 {
 	LOG_INFO("%s, clearing queue", m_queue_id.c_str());
 
+	// let pending pushes land before the queue content gets removed
+	flush_pushes();
+
 	LOG_INFO("%s, dropping statistics", m_queue_id.c_str());
 	clear_counters();
 
 	LOG_INFO("%s, erasing state", m_queue_id.c_str());
-	queue_state state = m_state;
-	memset(&m_state, 0, sizeof(m_state));
-	write_state();
+	for (int lane = 0; lane < (int)m_lanes.size(); ++lane) {
+		queue_state &state = m_lanes[lane].state;
+
+		LOG_INFO("%s, lane %d, removing chunks, from %d to %d", m_queue_id.c_str(), lane, state.chunk_id_ack, state.chunk_id_push);
+		state.chunk_id_push = lane_base(lane);
+		state.chunk_id_ack = lane_base(lane);
+		write_state(lane);
+	}
 
-	LOG_INFO("%s, removing chunks, from %d to %d", m_queue_id.c_str(), state.chunk_id_ack, state.chunk_id_push);
 	std::map<int, shared_chunk> remove_list;
 	remove_list.swap(m_chunks);
 	remove_list.insert(m_wait_ack.cbegin(), m_wait_ack.cend());
 	m_wait_ack.clear();
 
+	m_deadlines.clear();
+	m_timeouts->clear();
+	m_redeliver.clear();
+	m_nack_delayed.clear();
+
+	m_cache.clear();
+	m_cache_index.clear();
+	m_cache_bytes = 0;
+
+	m_load_line.clear();
+	m_load_failures.clear();
+
+	// delayed chunks go too (promotions in flight still push their entries)
+	for (const auto &i : m_delayed) {
+		auto found = m_delayed_chunks.find(i.first);
+		if (found != m_delayed_chunks.end()) {
+			found->second->remove();
+		} else {
+			chunk(*m_data_client.get(), m_delayed_id, i.first, m_chunk_max, m_journal_max).remove();
+		}
+	}
+	m_delayed.clear();
+	m_delayed_chunks.clear();
+	m_delayed_open.clear();
+	m_delay_timers->clear();
+	write_delayed_state();
+
 	for (auto i = remove_list.cbegin(); i != remove_list.cend(); ++i) {
 		auto chunk = i->second;
 		chunk->remove();
@@ -154,350 +473,1580 @@ void queue::clear()
 
 	remove_list.clear();
 
+	// peeks waiting for cleared chunks get nothing
+	resume_peeks(false);
+
 	LOG_INFO("%s, queue cleared", m_queue_id.c_str());
 }
 
-void queue::push(const ioremap::elliptics::data_pointer &d)
+int queue::push_lane(int priority) const
+{
+	return std::min(std::max(priority, 0), (int)m_lanes.size() - 1);
+}
+
+shared_chunk queue::push_chunk(int lane)
 {
-	auto found = m_chunks.find(m_state.chunk_id_push);
+	int chunk_id = m_lanes[lane].state.chunk_id_push;
+
+	auto found = m_chunks.find(chunk_id);
 	if (found == m_chunks.end()) {
 		// create new empty chunk
-		auto p = std::make_shared<chunk>(*m_data_client.get(), m_queue_id, m_state.chunk_id_push, m_chunk_max);
-		auto inserted = m_chunks.insert(std::make_pair(m_state.chunk_id_push, p));
+		auto p = std::make_shared<chunk>(*m_data_client.get(), m_queue_id, chunk_id, m_chunk_max, m_journal_max);
+		p->set_loaded();
+		auto inserted = m_chunks.insert(std::make_pair(chunk_id, p));
 
 		found = inserted.first;
 	}
 
-	int chunk_id = found->first;
-	auto chunk = found->second;
-
-	if (chunk->push(d)) {
-		LOG_INFO("%s, chunk %d filled", m_queue_id.c_str(), chunk_id);
-
-		++m_state.chunk_id_push;
-		write_state();
-
-		chunk->add(&m_statistics.chunks_pushed);
-	}
-
-	++m_statistics.push_count;
+	return found->second;
 }
 
-ioremap::elliptics::data_pointer queue::peek(entry_id *entry_id)
+void queue::push_chunk_filled(shared_chunk chunk)
 {
-	check_timeouts();
-
-	ioremap::elliptics::data_pointer d;
-	*entry_id = {-1, -1};
+	LOG_INFO("%s, chunk %d filled", m_queue_id.c_str(), chunk->id());
 
-	while (true) {
-		auto found = m_chunks.begin();
-		if (found == m_chunks.end()) {
-			break;
-		}
-
-		int chunk_id = found->first;
-		auto chunk = found->second;
+	int lane = lane_of(chunk->id());
+	++m_lanes[lane].state.chunk_id_push;
+	write_state(lane);
 
-		entry_id->chunk = chunk_id;
-		d = chunk->pop(&entry_id->pos);
+	// writes in flight could still fail, chunk is sealed at what lands then
+	chunk->close();
 
-		LOG_INFO("%s, popping entry %d-%d (%ld)'%s'", m_queue_id.c_str(), entry_id->chunk, entry_id->pos, d.size(), d.to_string());
-		if (!d.empty()) {
-			m_statistics.pop_count++;
-
-			// set or reset timeout timer for the chunk
-			update_chunk_timeout(chunk_id, chunk);
+	chunk->add(&m_statistics.chunks_pushed);
+}
 
-		}
+bool queue::is_push_chunk(int chunk_id) const
+{
+	int lane = lane_of(chunk_id);
+	return lane < (int)m_lanes.size() && chunk_id == m_lanes[lane].state.chunk_id_push;
+}
 
-		if (chunk_id == m_state.chunk_id_push) {
-			break;
-		}
+void queue::push(const ioremap::elliptics::data_pointer &d, const push_handler &handler, int priority)
+{
+	int lane = push_lane(priority);
 
-		if (chunk->expect_no_more()) {
-			//FIXME: this could happen to be called many times for the same chunk
-			// (between queue restarts or because of chunk replaying)
-			chunk->add(&m_statistics.chunks_popped);
+	uint32_t expire = expire_time(0, 0);
 
-			LOG_INFO("%s, chunk %d exhausted, dropped from the popping line", m_queue_id.c_str(), chunk_id);
+	if (!m_push_linger_time) {
+		push_entries(lane, d, std::vector<int>(1, d.size()), std::vector<uint32_t>(expire ? 1 : 0, expire), handler);
+		return;
+	}
 
-			// drop chunk from the pop list
-			m_chunks.erase(found);
-		} else if (d.empty()) {
-			// this is error condition: middle chunk must give some data but gives none
-			break;
-		}
+	// Gather pushes arriving within the linger window into a single group,
+	// which goes to the storage as one append (and one meta update) per chunk.
+	push_group &group = m_lanes[lane].group;
+	if (group.sizes.empty()) {
+		group.deadline = microseconds_now() + m_push_linger_time;
+		schedule(group.deadline);
+	}
 
-		break;
+	group.data.append((const char *)d.data(), d.size());
+	group.sizes.push_back(d.size());
+	if (expire) {
+		group.expires.resize(group.sizes.size() - 1, 0);
+	}
+	if (!group.expires.empty()) {
+		group.expires.push_back(expire);
 	}
+	group.handlers.push_back(handler);
 
-	return d;
+	if (group.data.size() >= m_push_linger_bytes || (int)group.sizes.size() >= m_chunk_max) {
+		flush_pushes(lane);
+	}
 }
 
-void queue::update_chunk_timeout(int chunk_id, shared_chunk chunk)
+void queue::push(const data_array &d, const push_handler &handler, int priority, int ttl)
 {
-	// add chunk to the waiting list and postpone its deadline time
-	m_wait_ack.insert({chunk_id, chunk});
-	//TODO: make acking timeout value configurable
-	chunk->reset_time(m_ack_wait_timeout);
+	int lane = push_lane(priority);
+
+	// keep entries order: pushes already waiting in the group go first
+	flush_pushes(lane);
+
+	uint32_t expire = expire_time(ttl, 0);
+	push_entries(lane, ioremap::elliptics::data_pointer::copy(d.data().data(), d.data().size()), d.sizes(),
+			std::vector<uint32_t>(expire ? d.sizes().size() : 0, expire), handler);
 }
 
-void queue::check_timeouts()
+void queue::push_delayed(const data_array &d, int64_t deliver_at, const push_handler &handler, int priority, int ttl)
 {
-	uint64_t now = microseconds_now();
+	int lane = push_lane(priority);
 
-	// check no more then once in 1 second
-	//TODO: make timeout check interval configurable
-	if ((now - m_last_timeout_check_time) < m_timeout_check_period) {
+	if (deliver_at <= milliseconds_since_epoch()) {
+		push(d, handler, lane, ttl);
 		return;
 	}
-	m_last_timeout_check_time = now;
 
-	LOG_INFO("%s, checking timeouts: %ld waiting chunks", m_queue_id.c_str(), m_wait_ack.size());
+	// entries are never delivered early, bucket's time is the end of its interval
+	int64_t due = (deliver_at + m_delay_bucket - 1) / m_delay_bucket * m_delay_bucket;
 
-	auto i = m_wait_ack.begin();
-	while (i != m_wait_ack.end()) {
-		int chunk_id = i->first;
-		auto chunk = i->second;
+	LOG_INFO("%s, lane %d, delaying %ld entries until %lld", m_queue_id.c_str(), lane, d.sizes().size(), (long long)due);
+	m_statistics.delay_count += d.sizes().size();
 
-		if (now < chunk->get_time()) {
-			++i;
-			continue;
-		}
+	uint32_t expire = expire_time(ttl, deliver_at);
+	push_entries(lane, ioremap::elliptics::data_pointer::copy(d.data().data(), d.data().size()), d.sizes(),
+			std::vector<uint32_t>(expire ? d.sizes().size() : 0, expire), handler, due);
+}
 
-		// Time passed but chunk still is not complete
-		// so we must replay unacked items from it.
-		LOG_ERROR("%s, chunk %d timed out, returning back to the popping line (due time was %ldus ago)",
-				m_queue_id.c_str(),
-				chunk_id,
-				now - chunk->get_time()
-				);
-
-		// There are two cases when chunk can still be in m_chunks
-		// while experiencing a timeout:
-		// 1) if it's a single chunk in the queue (and serves both
-		//    as a push and a pop/ack target)
-		// 2) if iteration of this chunk was preempted by other timed out chunk
-		//    and then later this chunk timed out in its turn
-		// Timeout require switching chunk's iteration into the replay mode.
-
-		auto inserted = m_chunks.insert({chunk_id, chunk});
-		if (!inserted.second) {
-			LOG_INFO("%s, chunk %d is already in popping line", m_queue_id.c_str(), chunk_id);
-		} else {
-			LOG_INFO("%s, chunk %d inserted back to the popping line anew", m_queue_id.c_str(), chunk_id);
-		}
-		chunk->reset_iteration();
+uint32_t queue::expire_time(int ttl, int64_t deliver_at) const
+{
+	if (!ttl) {
+		ttl = m_ttl;
+	}
+	if (ttl <= 0) {
+		return 0;
+	}
 
-		auto hold = i;
-		++i;
-		m_wait_ack.erase(hold);
+	if (!deliver_at) {
+		deliver_at = milliseconds_since_epoch();
+	}
+	return deliver_at / 1000 + ttl;
+}
 
-		// number of popped but still unacked entries
-		m_statistics.timeout_count += (chunk->meta().low_mark() - chunk->meta().acked());
+void queue::flush_pushes()
+{
+	for (int lane = 0; lane < (int)m_lanes.size(); ++lane) {
+		flush_pushes(lane);
 	}
 }
 
-void queue::ack(const entry_id id)
+void queue::flush_pushes(int lane)
 {
-	auto found = m_wait_ack.find(id.chunk);
-	if (found == m_wait_ack.end()) {
-		LOG_ERROR("%s, ack for chunk %d (pos %d) which is not in waiting list", m_queue_id.c_str(), id.chunk, id.pos);
+	if (m_lanes[lane].group.sizes.empty()) {
 		return;
 	}
 
-	auto chunk = found->second;
-	chunk->ack(id.pos, true);
-	if (chunk->meta().acked() == chunk->meta().low_mark()) {
-		// Real end of the chunk's lifespan, all popped entries are acked
-
-		m_wait_ack.erase(found);
+	push_group group;
+	std::swap(group, m_lanes[lane].group);
 
-		chunk->add(&m_statistics.chunks_popped);
+	LOG_INFO("%s, lane %d, push group, flushing %ld entries, %ld bytes", m_queue_id.c_str(), lane, group.sizes.size(), group.data.size());
 
-		// Chunk would be uncomplete here only if its the only chunk in the queue
-		// (filled partially and serving both as a push and a pop/ack target)
-		if (chunk->meta().complete()) {
-			chunk->remove();
-			LOG_INFO("%s, ack, chunk %d complete", m_queue_id.c_str(), id.chunk);
-		}
+	// all producers of the group get their replies together
+	auto handlers = std::make_shared<std::vector<push_handler>>();
+	handlers->swap(group.handlers);
 
-		// Set chunk_id_ack to the lowest active chunk
-		//NOTE: its important to have m_chunks and m_wait_ack both sorted
-		m_state.chunk_id_ack = m_state.chunk_id_push;
-		if (!m_chunks.empty()) {
-			m_state.chunk_id_ack = std::min(m_state.chunk_id_ack, m_chunks.begin()->first);
-		}
-		if (!m_wait_ack.empty()) {
-			m_state.chunk_id_ack = std::min(m_state.chunk_id_ack, m_wait_ack.begin()->first);
+	push_entries(lane, ioremap::elliptics::data_pointer::copy(group.data.data(), group.data.size()), group.sizes, group.expires,
+		[handlers] (const ioremap::elliptics::error_info &error) {
+			for (const auto &handler : *handlers) {
+				if (handler) {
+					handler(error);
+				}
+			}
 		}
+	);
+}
 
-		write_state();
+void queue::push_entries(int lane, const ioremap::elliptics::data_pointer &data, const std::vector<int> &sizes,
+		const std::vector<uint32_t> &expires, const push_handler &handler, int64_t due,
+		const std::function<void (size_t)> &progress)
+{
+	push_batch batch{lane, due, data, sizes, expires, handler, progress};
+
+	// Bounded in-flight window: batches wait here (without blocking the worker)
+	// until completing writes free some slots (or the push chunk rolls back failed writes)
+	if (m_push_inflight >= m_push_inflight_max || !m_push_backlog.empty() || push_stalled(batch)) {
+		LOG_INFO("%s, push, in-flight window is full (%d appends), %ld batches waiting",
+				m_queue_id.c_str(), m_push_inflight, m_push_backlog.size() + 1);
+		m_push_backlog.push_back(batch);
+		return;
 	}
 
-	++m_statistics.ack_count;
+	write_entries(batch);
 }
 
-ioremap::elliptics::data_pointer queue::pop()
+void queue::flush_push_backlog()
 {
-	entry_id id;
-	ioremap::elliptics::data_pointer d = peek(&id);
-	if (!d.empty()) {
-		ack(id);
+	while (m_push_inflight < m_push_inflight_max && !m_push_backlog.empty() && !push_stalled(m_push_backlog.front())) {
+		push_batch batch = m_push_backlog.front();
+		m_push_backlog.pop_front();
+
+		write_entries(batch);
 	}
-	return d;
 }
 
-data_array queue::pop(int num)
+void queue::fail_push_backlog(const ioremap::elliptics::error_info &error)
 {
-	data_array d = peek(num);
-	if (!d.empty()) {
-		ack(d.ids());
+	std::deque<push_batch> backlog;
+	std::swap(backlog, m_push_backlog);
+
+	for (const auto &batch : backlog) {
+		if (batch.progress) {
+			batch.progress(0);
+		}
+		if (batch.handler) {
+			batch.handler(error);
+		}
 	}
-	return d;
 }
 
-data_array queue::peek(int num)
+bool queue::push_stalled(const push_batch &batch)
 {
-	check_timeouts();
-
-	data_array ret;
+	// delayed chunk which is rolling back is not taken by delay_chunk(), bucket gets another one
+	return !batch.due && push_chunk(batch.lane)->rolling_back();
+}
 
-	while (num > 0) {
-		auto found = m_chunks.begin();
-		if (found == m_chunks.end()) {
-			break;
+void queue::write_entries(const push_batch &batch)
+{
+	// Batch is complete when writes to all touched chunks are durable,
+	// the first error (if any) is reported.
+	struct batch_state {
+		int parts;
+		// entries before the first failed part are written
+		size_t written;
+		ioremap::elliptics::error_info error;
+		push_handler handler;
+		std::function<void (size_t)> progress;
+	};
+	auto state = std::make_shared<batch_state>();
+	// extra part holds the batch from completion until all appends are issued
+	state->parts = 1;
+	state->written = batch.sizes.size();
+	state->handler = batch.handler;
+	state->progress = batch.progress;
+
+	auto part_complete = [this, state] (const ioremap::elliptics::error_info &error) {
+		if (error && !state->error) {
+			state->error = error;
 		}
-
-		int chunk_id = found->first;
-		auto chunk = found->second;
-
-		data_array d = chunk->pop(num);
-		LOG_INFO("%s, chunk %d, popping %d entries", m_queue_id.c_str(), chunk_id, d.sizes().size());
-		//DEBUG
-		for (const auto &i : d.ids()) {
-			LOG_INFO("%s, chunk %d, pos %d, state %d", m_queue_id.c_str(), i.chunk, i.pos, chunk->meta()[i.pos].state);
+		if (--state->parts == 0) {
+			if (state->progress) {
+				state->progress(state->written);
+			}
+			if (state->handler) {
+				state->handler(state->error);
+			}
 		}
+	};
 
-		if (!d.empty()) {
-			m_statistics.pop_count += d.sizes().size();
+	// Chunk's part is done when its journal records are written,
+	// which is completed in the storage thread. Part holds its in-flight slot till then.
+	auto chunk_part_complete = [this, state, part_complete] (const ioremap::elliptics::error_info &error, size_t begin) {
+		auto guard = lock();
 
-			ret.extend(d);
+		--m_push_inflight;
+		if (error) {
+			state->written = std::min(state->written, begin);
+		}
+		part_complete(error);
+
+		flush_push_backlog();
+		m_timer_condition.notify_all();
+	};
+
+	const std::vector<int> &sizes = batch.sizes;
+	size_t index = 0;
+	uint64_t offset = 0;
+
+	// Split entries at chunk boundaries: every chunk touched gets
+	// exactly one data append and one meta update.
+	while (index < sizes.size()) {
+		auto chunk = batch.due ? delay_chunk(batch.due, batch.lane) : push_chunk(batch.lane);
+
+		size_t count = std::min(sizes.size() - index, (size_t)chunk->capacity());
+		std::vector<int> part(sizes.begin() + index, sizes.begin() + index + count);
+		std::vector<uint32_t> part_expires;
+		if (!batch.expires.empty()) {
+			part_expires.assign(batch.expires.begin() + index, batch.expires.begin() + index + count);
+		}
+		uint64_t part_size = std::accumulate(part.begin(), part.end(), (uint64_t)0);
 
-			// set or reset timeout timer for the chunk
-			update_chunk_timeout(chunk_id, chunk);
+		LOG_INFO("%s, push, chunk %d, pushing %ld entries", m_queue_id.c_str(), chunk->id(), count);
 
-		}
+		++state->parts;
+		++m_push_inflight;
 
-		if (chunk_id == m_state.chunk_id_push) {
-			break;
+		uint64_t write_id;
+		auto result = chunk->push(batch.data.slice(offset, part_size), part,
+				std::bind(chunk_part_complete, std::placeholders::_1, index), &write_id, part_expires);
+		if (batch.due) {
+			// delayed entries are read back when due, they are not kept in memory till then
+			chunk->drop_cache();
+		} else {
+			cache_touch(chunk);
+			if (chunk->full()) {
+				push_chunk_filled(chunk);
+			}
 		}
 
-		if (chunk->expect_no_more()) {
-			//FIXME: this could happen to be called many times for the same chunk
-			// (between queue restarts or because of chunk replaying)
-			chunk->add(&m_statistics.chunks_popped);
+		// Producers are replied only when entries are durable,
+		// while the worker goes on serving other requests.
+		bool delayed = batch.due != 0;
+		result.connect(ioremap::elliptics::async_write_result::result_function(),
+			[this, chunk, write_id, delayed] (const ioremap::elliptics::error_info &error) {
+				auto guard = lock();
+
+				chunk->push_complete(write_id, error);
+
+				// failed writes are rolled back, batches which wait for that go on
+				if (!delayed) {
+					cache_touch(chunk);
+					if (is_push_chunk(chunk->id()) && chunk->full()) {
+						push_chunk_filled(chunk);
+					}
+				}
+
+				flush_push_backlog();
+				// long polls get the entries just published
+				resume_peeks(true);
+				m_timer_condition.notify_all();
+			}
+		);
 
-			LOG_INFO("%s, chunk %d exhausted, dropped from the popping line", m_queue_id.c_str(), chunk_id);
+		index += count;
+		offset += part_size;
+	}
 
-			// drop chunk from the pop list
-			m_chunks.erase(found);
+	if (!batch.due) {
+		m_statistics.push_count += sizes.size();
+	}
 
-		} else if (d.empty()) {
-			// this is error condition: middle chunk must give some data but gives none
-			break;
-		}
+	part_complete(ioremap::elliptics::error_info());
+}
 
-		num -= d.sizes().size();
+void queue::write_delayed_state()
+{
+	delayed_state state;
+	state.chunk_id_next = m_delayed_chunk_next;
+	for (const auto &i : m_delayed) {
+		state.chunks.push_back(i.second);
 	}
 
-	return ret;
+	m_data_client->write_data(m_delayed_state_id, serialize(state), 0);
+
+	m_statistics.state_write_count++;
 }
 
-void queue::ack(const std::vector<entry_id> &ids)
+shared_chunk queue::delay_chunk(int64_t due, int lane)
 {
-	// Collect affected chunk set
-	std::unordered_set<shared_chunk> affected_chunks;
-	auto found = m_wait_ack.end();
-
-	for (const auto &id : ids) {
-		// sequential case optimization
-		if (found == m_wait_ack.end() || found->second->id() != id.chunk) {
-			found = m_wait_ack.find(id.chunk);
-			if (found == m_wait_ack.end()) {
-				LOG_ERROR("%s, ack for chunk %d (pos %d) which is not in waiting list", m_queue_id.c_str(), id.chunk, id.pos);
-				continue;
-			}
+	auto open = m_delayed_open.find(std::make_pair(due, lane));
+	if (open != m_delayed_open.end()) {
+		auto found = m_delayed_chunks.find(open->second);
+		if (found != m_delayed_chunks.end() && !found->second->full() && !found->second->rolling_back()) {
+			return found->second;
 		}
-		auto chunk = found->second;
+	}
 
-		affected_chunks.insert(chunk);
+	// Bucket gets a new chunk, which is recorded before anything is appended to it,
+	// so that restarted queue knows every chunk which could have entries.
+	delayed_chunk record{m_delayed_chunk_next++, due, lane, 0};
 
-		// ack without saving meta
-		LOG_INFO("%s, ack, chunk %d, pos %d, state %d", m_queue_id.c_str(), id.chunk, id.pos, chunk->meta()[id.pos].state);
-		chunk->ack(id.pos, false);
+	auto p = std::make_shared<chunk>(*m_data_client.get(), m_delayed_id, record.chunk_id, m_chunk_max, m_journal_max);
+	p->set_loaded();
 
-		if (chunk->meta().acked() == chunk->meta().low_mark()) {
-			// Real end of the chunk's lifespan, all popped entries are acked
+	m_delayed[record.chunk_id] = record;
+	m_delayed_chunks[record.chunk_id] = p;
+	m_delayed_open[std::make_pair(due, lane)] = record.chunk_id;
+	write_delayed_state();
 
-			m_wait_ack.erase(found);
-			found = m_wait_ack.end();
+	LOG_INFO("%s, lane %d, delayed chunk %d is created for %lld", m_queue_id.c_str(), lane, record.chunk_id, (long long)due);
 
-			// Set chunk_id_ack to the lowest active chunk
-			//NOTE: its important to have m_chunks and m_wait_ack both sorted
-			m_state.chunk_id_ack = m_state.chunk_id_push;
-			if (!m_chunks.empty()) {
-				m_state.chunk_id_ack = std::min(m_state.chunk_id_ack, m_chunks.begin()->first);
-			}
-			if (!m_wait_ack.empty()) {
-				m_state.chunk_id_ack = std::min(m_state.chunk_id_ack, m_wait_ack.begin()->first);
-			}
+	schedule_promotion(record, microseconds_now());
+	return p;
+}
 
-			// writing state before any other external actions to ensure state correctness
-			write_state();
+void queue::schedule_promotion(const delayed_chunk &record, uint64_t now)
+{
+	int64_t wait = record.due - milliseconds_since_epoch();
+	uint64_t deadline = now + (wait > 0 ? wait * 1000 : 0);
 
-			// Chunk would be uncomplete here only if its the only chunk in the queue
-			// (filled partially and serving both as a push and a pop/ack target)
-			if (chunk->meta().complete()) {
-				chunk->remove();
-				affected_chunks.erase(chunk);
-				LOG_INFO("%s, ack, chunk %d complete", m_queue_id.c_str(), id.chunk);
-			}
+	m_delay_timers->add(now, deadline, record.chunk_id);
+	schedule(deadline);
+}
 
-			chunk->add(&m_statistics.chunks_popped);
-		}
+void queue::expire_delays(uint64_t now)
+{
+	std::vector<int> due;
+	m_delay_timers->advance(now, [&due] (int chunk_id, uint64_t) {
+		due.push_back(chunk_id);
+	});
 
-		affected_chunks.insert(chunk);
+	for (int chunk_id : due) {
+		promote(chunk_id);
+	}
+
+	if (!m_delay_timers->empty()) {
+		schedule(m_delay_timers->next_time());
+	}
+}
+
+void queue::promote(int chunk_id)
+{
+	auto record = m_delayed.find(chunk_id);
+	if (record == m_delayed.end() || m_promoting.count(chunk_id)) {
+		return;
+	}
 
-		++m_statistics.ack_count;
+	// bucket takes no more pushes into this chunk
+	auto open = m_delayed_open.find(std::make_pair(record->second.due, record->second.lane));
+	if (open != m_delayed_open.end() && open->second == chunk_id) {
+		m_delayed_open.erase(open);
 	}
 
-	// then save meta for all affected chunks
-	for (const auto &chunk : affected_chunks) {
-		LOG_INFO("%s, ack, chunk %d, write meta, acked %d, low %d", m_queue_id.c_str(), chunk->id(), chunk->meta().acked(), chunk->meta().low_mark());
-		chunk->write_meta();
+	shared_chunk &slot = m_delayed_chunks[chunk_id];
+	if (!slot) {
+		// chunk of the previous run
+		slot = std::make_shared<ioremap::grape::chunk>(*m_data_client.get(), m_delayed_id, chunk_id, m_chunk_max, m_journal_max);
+	}
+	shared_chunk chunk = slot;
+
+	if (chunk->pushing()) {
+		// appends are still in flight, try on the next tick
+		uint64_t now = microseconds_now();
+		m_delay_timers->add(now, now + m_timeout_tick, chunk_id);
+		schedule(now + m_timeout_tick);
+		return;
+	}
+
+	LOG_INFO("%s, delayed chunk %d is due, promoting it to lane %d", m_queue_id.c_str(), chunk_id, record->second.lane);
+	m_promoting.insert(chunk_id);
+
+	if (chunk->loaded()) {
+		promote_read(chunk_id, chunk);
+		return;
 	}
+
+	++m_io_inflight;
+	load_chunk(chunk, [this, chunk_id, chunk] (bool found, bool ok) {
+		--m_io_inflight;
+
+		if (!ok) {
+			promote_failed(chunk_id);
+		} else if (!found) {
+			// nothing was ever appended
+			chunk->set_loaded();
+			promote_push(chunk_id, chunk);
+		} else {
+			promote_read(chunk_id, chunk);
+		}
+		m_timer_condition.notify_all();
+	});
 }
 
-void queue::reply(cocaine::framework::response_ptr response, const ioremap::elliptics::exec_context &context,
-		const ioremap::elliptics::argument_data &d, ioremap::elliptics::exec_context::final_state state)
+void queue::promote_read(int chunk_id, const shared_chunk &chunk)
 {
-	m_reply_client->reply(context, d, state).connect(
-		ioremap::elliptics::async_reply_result::result_function(),
-		[this, response] (const ioremap::elliptics::error_info &error) {
+	if (!chunk->need_prefetch()) {
+		promote_push(chunk_id, chunk);
+		return;
+	}
+
+	auto data = std::make_shared<ioremap::elliptics::data_pointer>();
+	++m_io_inflight;
+
+	chunk->prefetch().connect(
+		[data] (const ioremap::elliptics::read_result_entry &entry) {
+			*data = entry.file();
+		},
+		[this, chunk_id, chunk, data] (const ioremap::elliptics::error_info &error) {
+			auto guard = lock();
+
+			--m_io_inflight;
+			chunk->prefetch_complete(*data, error);
 			if (error) {
-				LOG_ERROR("%s, reply error: %s", m_queue_id.c_str(), error.message().c_str());
+				promote_failed(chunk_id);
 			} else {
-				//LOG_INFO("%s, replied", m_queue_id.c_str());
+				promote_push(chunk_id, chunk);
 			}
+			m_timer_condition.notify_all();
 		}
 	);
 }
 
-void queue::final(cocaine::framework::response_ptr response, const ioremap::elliptics::exec_context &context, const ioremap::elliptics::argument_data &d)
+void queue::promote_push(int chunk_id, const shared_chunk &chunk)
 {
-	reply(response, context, d, ioremap::elliptics::exec_context::final);
+	auto record = m_delayed.find(chunk_id);
+	if (record == m_delayed.end()) {
+		// queue was cleared meanwhile
+		m_promoting.erase(chunk_id);
+		return;
+	}
+	int lane = record->second.lane;
+	int promoted = record->second.promoted;
+
+	data_array popped = chunk->pop(chunk->meta().high_mark());
+	if (chunk->data_wanted()) {
+		// data object is shorter than its meta tells
+		promote_failed(chunk_id);
+		return;
+	}
+
+	// entries pushed to the lane by an earlier try are not pushed again
+	data_array d;
+	for (const auto &entry : popped) {
+		if (entry.entry_id.pos >= promoted) {
+			d.append(entry);
+		}
+	}
+
+	// Promotion position moves past the entries written to the lane (expired ones
+	// in between are counted then), so that a failed try is resumed from there.
+	std::vector<entry_id> ids = d.ids();
+	auto progress = [this, chunk_id, chunk, ids, promoted] (size_t written) {
+		auto record = m_delayed.find(chunk_id);
+		if (record == m_delayed.end()) {
+			return;
+		}
+
+		int next = written < ids.size() ? ids[written].pos : chunk->meta().high_mark();
+		size_t expired = std::count_if(chunk->expired().begin(), chunk->expired().end(),
+			[promoted, next] (int32_t pos) {
+				return pos >= promoted && pos < next;
+			});
+		if (expired) {
+			LOG_INFO("%s, delayed chunk %d, %ld entries expired while delayed", m_queue_id.c_str(), chunk_id, expired);
+			m_statistics.expire_count += expired;
+		}
+		m_statistics.promote_count += written;
+
+		record->second.promoted = next;
+		if (next != promoted && written < ids.size()) {
+			write_delayed_state();
+		}
+	};
+
+	auto complete = [this, chunk_id, chunk] (const ioremap::elliptics::error_info &error) {
+		if (error) {
+			promote_failed(chunk_id);
+			return;
+		}
+
+		LOG_INFO("%s, delayed chunk %d is promoted", m_queue_id.c_str(), chunk_id);
+
+		m_promoting.erase(chunk_id);
+		m_delayed_chunks.erase(chunk_id);
+		if (m_delayed.erase(chunk_id)) {
+			write_delayed_state();
+		}
+		chunk->remove();
+	};
+
+	if (d.empty()) {
+		progress(0);
+		complete(ioremap::elliptics::error_info());
+		return;
+	}
+
+	// entries keep expiry times they were pushed with
+	std::vector<uint32_t> expires;
+	if (chunk->meta().expiring()) {
+		for (const auto &id : d.ids()) {
+			expires.push_back(chunk->meta().expire(id.pos));
+		}
+	}
+
+	flush_pushes(lane);
+	push_entries(lane, ioremap::elliptics::data_pointer::copy(d.data().data(), d.data().size()), d.sizes(), expires,
+			complete, 0, progress);
+}
+
+void queue::promote_failed(int chunk_id)
+{
+	LOG_ERROR("%s, delayed chunk %d promotion failed, it will be tried again in %lld ms",
+			m_queue_id.c_str(), chunk_id, (long long)m_delay_bucket);
+
+	// chunk will be loaded anew, its popped entries are not lost that way,
+	// entries already pushed to the lane are skipped by the next try
+	m_promoting.erase(chunk_id);
+	m_delayed_chunks.erase(chunk_id);
+
+	uint64_t now = microseconds_now();
+	m_delay_timers->add(now, now + m_delay_bucket * 1000, chunk_id);
+	schedule(now + m_delay_bucket * 1000);
+}
+
+void queue::load_chunks()
+{
+	while ((int)m_loading.size() < m_load_parallel && !m_load_line.empty()) {
+		auto chunk = m_load_line.front();
+		m_load_line.pop_front();
+
+		if (chunk->loaded() || m_loading.count(chunk->id())) {
+			continue;
+		}
+
+		m_loading.insert(chunk->id());
+
+		load_chunk(chunk, [this, chunk] (bool found, bool ok) {
+			m_loading.erase(chunk->id());
+
+			if (!ok) {
+				// next peek will try to load it again when it gets to the chunk,
+				// unless chunks which can not be read are skipped
+				if (++m_load_failures[chunk->id()] >= defaults::LOAD_ATTEMPTS && m_skip_missing_chunks) {
+					m_load_failures.erase(chunk->id());
+					chunk_missing(chunk->id());
+				}
+			} else {
+				m_load_failures.erase(chunk->id());
+				if (!found) {
+					chunk_missing(chunk->id());
+				} else if (!is_push_chunk(chunk->id())) {
+					// writes which were in flight on crash could leave room behind
+					chunk->close();
+				}
+			}
+
+			load_chunks();
+			resume_peeks(ok);
+			m_timer_condition.notify_all();
+		});
+	}
+}
+
+void queue::load_chunk(const shared_chunk &chunk, const std::function<void (bool found, bool ok)> &handler)
+{
+	// meta and journal are read in parallel, chunk is loaded when both are done
+	struct load_state {
+		int parts;
+		ioremap::elliptics::data_pointer meta;
+		ioremap::elliptics::data_pointer journal;
+		ioremap::elliptics::error_info meta_error;
+		ioremap::elliptics::error_info journal_error;
+	};
+	auto state = std::make_shared<load_state>();
+	state->parts = 2;
+
+	auto part_complete = [this, chunk, state, handler] () {
+		if (--state->parts > 0) {
+			return;
+		}
+
+		bool found = true;
+		bool ok = true;
+		if (!chunk->loaded()) {
+			try {
+				found = chunk->load_complete(state->meta, state->meta_error, state->journal, state->journal_error);
+			} catch (const ioremap::elliptics::error &e) {
+				LOG_ERROR("%s, chunk %d, load failed: %s", m_queue_id.c_str(), chunk->id(), e.what());
+				ok = false;
+			}
+		}
+
+		handler(found, ok);
+	};
+
+	chunk->read_meta().connect(
+		[state] (const ioremap::elliptics::read_result_entry &entry) {
+			state->meta = entry.file();
+		},
+		[this, state, part_complete] (const ioremap::elliptics::error_info &error) {
+			auto guard = lock();
+			state->meta_error = error;
+			part_complete();
+		}
+	);
+	chunk->read_journal().connect(
+		[state] (const ioremap::elliptics::read_result_entry &entry) {
+			state->journal = entry.file();
+		},
+		[this, state, part_complete] (const ioremap::elliptics::error_info &error) {
+			auto guard = lock();
+			state->journal_error = error;
+			part_complete();
+		}
+	);
+}
+
+void queue::load_now(const shared_chunk &chunk)
+{
+	LOG_INFO("%s, chunk %d is not loaded yet, loading it now", m_queue_id.c_str(), chunk->id());
+
+	// popping has got to the chunk, it goes ahead of others
+	m_load_line.push_front(chunk);
+	load_chunks();
+}
+
+void queue::chunk_missing(int chunk_id)
+{
+	int lane = lane_of(chunk_id);
+	if (lane >= (int)m_lanes.size() || chunk_id >= m_lanes[lane].state.chunk_id_push) {
+		// push chunk could have no meta yet
+		return;
+	}
+
+	// Middle chunk must have meta, without it entries of the chunk are lost.
+	if (m_skip_missing_chunks) {
+		// chunk is dropped so that popping goes on with the next one
+		LOG_ERROR("%s, middle chunk %d meta data is missing, chunk is skipped", m_queue_id.c_str(), chunk_id);
+		m_chunks.erase(chunk_id);
+		return;
+	}
+
+	// Lane stops at the chunk (which is kept, as is the lane's state)
+	// until the meta is restored and the queue is restarted, other lanes go on
+	LOG_ERROR("%s, lane %d, middle chunk %d meta data is missing, lane is not served from it on",
+			m_queue_id.c_str(), lane, chunk_id);
+	int &missing = m_lanes[lane].missing_chunk;
+	if (missing < 0 || chunk_id < missing) {
+		missing = chunk_id;
+	}
+}
+
+int queue::missing_chunk(int lane) const
+{
+	return m_lanes[lane].missing_chunk;
+}
+
+void queue::cache_touch(const shared_chunk &chunk)
+{
+	uint64_t bytes = chunk->cached_bytes();
+
+	auto found = m_cache_index.find(chunk->id());
+	if (found != m_cache_index.end()) {
+		m_cache_bytes -= found->second->bytes;
+		found->second->bytes = bytes;
+		m_cache.splice(m_cache.begin(), m_cache, found->second);
+	} else {
+		m_cache.push_front(cache_entry{chunk, bytes});
+		m_cache_index[chunk->id()] = m_cache.begin();
+	}
+	m_cache_bytes += bytes;
+
+	// chunk in use is never evicted, even if it alone is over the budget
+	while (m_cache_max && m_cache_bytes > m_cache_max && m_cache.size() > 1) {
+		cache_entry &victim = m_cache.back();
+
+		LOG_INFO("%s, cache is over budget (%ld > %ld), dropping chunk %d data cache (%ld bytes)",
+				m_queue_id.c_str(), m_cache_bytes, m_cache_max, victim.chunk->id(), victim.bytes);
+
+		victim.chunk->drop_cache();
+		m_cache_bytes -= victim.bytes;
+		m_cache_index.erase(victim.chunk->id());
+		m_cache.pop_back();
+
+		++m_statistics.cache_evict_count;
+	}
+}
+
+void queue::cache_forget(int chunk_id)
+{
+	auto found = m_cache_index.find(chunk_id);
+	if (found == m_cache_index.end()) {
+		return;
+	}
+
+	m_cache_bytes -= found->second->bytes;
+	m_cache.erase(found->second);
+	m_cache_index.erase(found);
+}
+
+std::map<int, uint64_t> queue::cache_usage() const
+{
+	std::map<int, uint64_t> usage;
+	for (const auto &entry : m_cache) {
+		usage[entry.chunk->id()] = entry.bytes;
+	}
+	return usage;
+}
+
+void queue::read_ahead(std::map<int, shared_chunk>::iterator current)
+{
+	const chunk_meta &meta = current->second->meta();
+	if (m_read_ahead <= 0 || meta.max() - meta.low_mark() > m_read_ahead) {
+		return;
+	}
+
+	auto next = std::next(current);
+	if (next == m_chunks.end() || lane_of(next->first) != lane_of(current->first) ||
+			!next->second->loaded() || !next->second->need_prefetch()) {
+		return;
+	}
+
+	// Next chunk's data gets into its cache in background,
+	// so moving to it does not wait for the storage.
+	LOG_INFO("%s, chunk %d, read-ahead of chunk %d", m_queue_id.c_str(), current->first, next->first);
+	fetch(next->second);
+}
+
+void queue::fetch(const shared_chunk &chunk)
+{
+	if (!chunk->need_prefetch()) {
+		// read is already in flight (or there is nothing to read)
+		return;
+	}
+
+	auto data = std::make_shared<ioremap::elliptics::data_pointer>();
+	++m_io_inflight;
+
+	chunk->prefetch().connect(
+		[data] (const ioremap::elliptics::read_result_entry &entry) {
+			*data = entry.file();
+		},
+		[this, chunk, data] (const ioremap::elliptics::error_info &error) {
+			auto guard = lock();
+
+			--m_io_inflight;
+			chunk->prefetch_complete(*data, error);
+			cache_touch(chunk);
+
+			// nothing read means there is nothing more to wait for
+			resume_peeks(!error && !data->empty());
+			m_timer_condition.notify_all();
+		}
+	);
+}
+
+void queue::start_timeout(const entry_id &id, uint64_t now)
+{
+	uint64_t deadline = now + m_ack_wait_timeout;
+
+	m_deadlines[entry_key(id)] = deadline;
+	m_timeouts->add(now, deadline, id);
+
+	schedule(deadline);
+}
+
+void queue::stop_timeout(const entry_id &id)
+{
+	// stale timer is left in the wheel and ignored when fired
+	m_deadlines.erase(entry_key(id));
+	if (!m_nack_delayed.empty()) {
+		m_nack_delayed.erase(entry_key(id));
+	}
+}
+
+void queue::expire_timeouts(uint64_t now)
+{
+	size_t expired = 0;
+	size_t nacked = 0;
+
+	m_timeouts->advance(now, [this, &expired, &nacked] (const entry_id &id, uint64_t deadline) {
+		auto found = m_deadlines.find(entry_key(id));
+		if (found == m_deadlines.end() || found->second != deadline) {
+			// entry was acked or redelivered since
+			return;
+		}
+		m_deadlines.erase(found);
+
+		if (!m_nack_delayed.empty() && m_nack_delayed.erase(entry_key(id))) {
+			// nack delay is over, entry goes to the front of the line as nacked ones do
+			m_redeliver.push_front(id);
+			++nacked;
+			return;
+		}
+
+		// Only the entry itself goes back to consumers,
+		// the rest of its chunk is not replayed.
+		m_redeliver.push_back(id);
+		++expired;
+	});
+
+	if (expired) {
+		LOG_ERROR("%s, %ld entries timed out, %ld waiting for redelivery", m_queue_id.c_str(), expired, m_redeliver.size());
+		m_statistics.timeout_count += expired;
+	}
+	if (expired || nacked) {
+		resume_peeks(true);
+	}
+
+	if (!m_timeouts->empty()) {
+		schedule(m_timeouts->next_time());
+	}
+}
+
+bool queue::redeliver(entry_id *id, ioremap::elliptics::data_pointer *d, uint64_t max_bytes, int *attempts)
+{
+	while (!m_redeliver.empty()) {
+		entry_id next = m_redeliver.front();
+
+		// chunk leaves waiting list only when all its popped entries are acked
+		auto found = m_wait_ack.find(next.chunk);
+		if (found == m_wait_ack.end() || found->second->meta()[next.pos].state == chunk_entry::STATE_ACKED) {
+			m_redeliver.pop_front();
+			continue;
+		}
+
+		if (found->second->meta().expired(next.pos, milliseconds_since_epoch() / 1000)) {
+			LOG_INFO("%s, entry %d-%d expired, it is not redelivered", m_queue_id.c_str(), next.chunk, next.pos);
+			m_redeliver.pop_front();
+			m_statistics.expire_count++;
+			ack(next);
+			continue;
+		}
+
+		if (!found->second->read(next.pos, d)) {
+			// keep the entry until its data is read
+			fetch(found->second);
+			return false;
+		}
+		cache_touch(found->second);
+
+		if (max_bytes && d->size() > max_bytes) {
+			return false;
+		}
+
+		m_redeliver.pop_front();
+
+		*attempts = found->second->redelivered(next.pos);
+		write_journal(found->second);
+		if (m_max_deliveries && *attempts > m_max_deliveries) {
+			dead_letter(next, *attempts, *d);
+			continue;
+		}
+
+		LOG_INFO("%s, redelivering entry %d-%d, attempt %d", m_queue_id.c_str(), next.chunk, next.pos, *attempts);
+		*id = next;
+		m_statistics.pop_count++;
+		start_timeout(next, microseconds_now());
+
+		return true;
+	}
+
+	return false;
+}
+
+data_array queue::check_attempts(const shared_chunk &chunk, const data_array &d)
+{
+	bool redelivered = false;
+	bool dead = false;
+	for (size_t i = 0; i < d.sizes().size(); ++i) {
+		redelivered |= d.attempts(i) > 1;
+		dead |= m_max_deliveries && d.attempts(i) > m_max_deliveries;
+	}
+	if (!redelivered) {
+		return d;
+	}
+
+	// attempts are journaled by the chunk
+	write_journal(chunk);
+	if (!dead) {
+		return d;
+	}
+
+	m_wait_ack.insert({chunk->id(), chunk});
+
+	data_array alive;
+	for (const auto &entry : d) {
+		if (entry.attempts > m_max_deliveries) {
+			dead_letter(entry.entry_id, entry.attempts, ioremap::elliptics::data_pointer::copy(entry.data, entry.size));
+		} else {
+			alive.append(entry);
+		}
+	}
+	return alive;
+}
+
+void queue::dead_letter(const entry_id &id, int attempts, const ioremap::elliptics::data_pointer &d)
+{
+	LOG_ERROR("%s, entry %d-%d is not acked after %d deliveries, moving it to %s",
+			m_queue_id.c_str(), id.chunk, id.pos, attempts - 1, m_dead_letter_queue.c_str());
+	m_statistics.dead_letter_count++;
+
+	// entry is held under the ack timeout until the push is done:
+	// if the push fails (or its reply is lost), entry times out and tries again
+	start_timeout(id, microseconds_now());
+
+	dnet_id key;
+	memset(&key, 0, sizeof(dnet_id));
+	// key comes from the entry and its attempt (not from unseeded rand()),
+	// so pushes of different entries never share a key, even across restarts
+	m_reply_client->transform(cocaine::format("%s.dead.%d.%d.%d", m_queue_id, id.chunk, id.pos, attempts), key);
+
+	++m_io_inflight;
+
+	m_reply_client->exec(&key, -1, m_dead_letter_queue + "@push", d).connect(
+		ioremap::elliptics::async_result<ioremap::elliptics::exec_result_entry>::result_function(),
+		[this, id] (const ioremap::elliptics::error_info &error) {
+			auto guard = lock();
+
+			--m_io_inflight;
+			if (error) {
+				LOG_ERROR("%s, pushing entry %d-%d to %s failed: %s", m_queue_id.c_str(),
+						id.chunk, id.pos, m_dead_letter_queue.c_str(), error.message().c_str());
+			} else {
+				ack(id);
+			}
+			m_timer_condition.notify_all();
+		}
+	);
+}
+
+void queue::ack(const entry_id id)
+{
+	ack(std::vector<entry_range>(1, entry_range{id.chunk, id.pos, id.pos}));
+}
+
+void queue::update_ack_state()
+{
+	// Set chunk_id_ack of every lane to its lowest active chunk
+	//NOTE: its important to have m_chunks and m_wait_ack both sorted
+	for (int lane = 0; lane < (int)m_lanes.size(); ++lane) {
+		queue_state &state = m_lanes[lane].state;
+
+		// chunks of the next lanes are all above the push chunk
+		int chunk_id_ack = state.chunk_id_push;
+		auto found = m_chunks.lower_bound(lane_base(lane));
+		if (found != m_chunks.end()) {
+			chunk_id_ack = std::min(chunk_id_ack, found->first);
+		}
+		found = m_wait_ack.lower_bound(lane_base(lane));
+		if (found != m_wait_ack.end()) {
+			chunk_id_ack = std::min(chunk_id_ack, found->first);
+		}
+
+		if (chunk_id_ack != state.chunk_id_ack) {
+			state.chunk_id_ack = chunk_id_ack;
+			write_state(lane);
+		}
+	}
+}
+
+std::vector<int> queue::lane_quotas(int num)
+{
+	std::vector<int> quotas(m_lanes.size(), 0);
+
+	int total = 0;
+	for (const auto &lane : m_lanes) {
+		total += lane.weight;
+	}
+
+	// Smooth weighted round robin: every lane gets its weight in every @total
+	// entries, and in between lanes are interleaved, so a stream of small
+	// batches is shared by weights as well as a single big one.
+	// Its scores come back to where they were after @total picks.
+	int rounds = num / total;
+	for (size_t i = 0; i < m_lanes.size(); ++i) {
+		quotas[i] = rounds * m_lanes[i].weight;
+	}
+
+	for (int pick = rounds * total; pick < num; ++pick) {
+		size_t best = 0;
+		for (size_t i = 0; i < m_lanes.size(); ++i) {
+			m_lanes[i].score += m_lanes[i].weight;
+			if (m_lanes[i].score > m_lanes[best].score) {
+				best = i;
+			}
+		}
+		m_lanes[best].score -= total;
+		++quotas[best];
+	}
+
+	return quotas;
+}
+
+
+void queue::peek(int num, uint64_t max_bytes, uint64_t wait_time, int min_entries, const peek_handler &handler)
+{
+	auto request = std::make_shared<peek_request>();
+	request->num = num;
+	request->max_bytes = max_bytes;
+	request->bytes = 0;
+	// held entries must not time out before they are even given out
+	request->deadline = wait_time ? microseconds_now() + std::min(wait_time, m_ack_wait_timeout) : 0;
+	request->min_entries = std::max(min_entries, 1);
+	request->held = false;
+	request->handler = handler;
+
+	if (!serve_peek(request, true)) {
+		m_peek_waiting.push_back(request);
+	}
+}
+
+void queue::pop(int num, uint64_t max_bytes, uint64_t wait_time, int min_entries, const peek_handler &handler)
+{
+	peek(num, max_bytes, wait_time, min_entries, [this, handler] (const data_array &d) {
+		if (!d.empty()) {
+			ack(d.ids());
+		}
+		handler(d);
+	});
+}
+
+bool queue::serve_peek(const std::shared_ptr<peek_request> &request, bool wait)
+{
+	uint64_t now = microseconds_now();
+	if (request->deadline && request->deadline <= now) {
+		// long poll is over, whatever is at hand goes out
+		wait = false;
+	}
+
+	// some entries are on their way from the storage
+	bool waiting = false;
+
+	// Bytes left in the reply's budget for the next redelivered entry, 0 is no limit.
+	// First entry goes out regardless of its size, or an entry bigger
+	// than the limit would never be delivered.
+	auto room = [request] () -> uint64_t {
+		if (!request->max_bytes || request->entries.empty()) {
+			return 0;
+		}
+		return request->max_bytes > request->bytes ? request->max_bytes - request->bytes : 0;
+	};
+	auto spent = [request] () {
+		return request->max_bytes && request->bytes >= request->max_bytes;
+	};
+	bool budget_reached = false;
+
+	// timed out entries go first
+	entry_id id;
+	ioremap::elliptics::data_pointer d;
+	int attempts;
+	while (request->num > 0 && !spent() && redeliver(&id, &d, room(), &attempts)) {
+		request->entries.append((char *)d.data(), d.size(), id, attempts);
+		request->bytes += d.size();
+		--request->num;
+	}
+	if (request->num > 0 && !m_redeliver.empty()) {
+		// either waits for the data or is over the budget
+		waiting = true;
+		budget_reached = !request->entries.empty();
+	}
+
+	// Chunks are walked in pop order, but a chunk which waits for its data
+	// does not hold the walk: its read is issued and next chunks are tried,
+	// so reads for a big batch go in parallel and entries come from whichever
+	// chunks are ready (order is kept inside every chunk).
+	// @expected counts entries to come with the reads issued,
+	// no more reads are issued than needed for the batch.
+	int expected = 0;
+
+	// Lanes are walked in priority order as chunks of lane 0 go first.
+	// Weighted lanes are walked twice: first every lane takes no more
+	// than its quota of the batch, then the rest is filled by priority
+	// from lanes which have more (so no part of the batch is lost
+	// to a lane which has nothing).
+	std::vector<int> quotas;
+	if (m_lanes_weighted) {
+		quotas = lane_quotas(request->num);
+	}
+
+	// Expired entries are acked in place of being given out,
+	// chunks which are expired as a whole are dropped without reading their data
+	uint32_t now_s = milliseconds_since_epoch() / 1000;
+	std::vector<entry_id> expired;
+	std::vector<shared_chunk> dropped;
+	auto take_expired = [this, &expired] (const shared_chunk &chunk) {
+		if (chunk->expired().empty()) {
+			return;
+		}
+		LOG_INFO("%s, chunk %d, %ld entries expired", m_queue_id.c_str(), chunk->id(), chunk->expired().size());
+		m_statistics.expire_count += chunk->expired().size();
+
+		m_wait_ack.insert({chunk->id(), chunk});
+		for (auto pos : chunk->expired()) {
+			expired.push_back(entry_id{chunk->id(), pos});
+		}
+	};
+
+	// Lane which waits for a chunk to load (or is stuck at a chunk which gives nothing)
+	// is not walked any further, so that entries come in order, but other lanes go on
+	std::vector<bool> stalled(m_lanes.size(), false);
+
+	for (int pass = quotas.empty() ? 1 : 0; pass < 2; ++pass) {
+		bool quoted = (pass == 0);
+
+		auto next = m_chunks.begin();
+		while (request->num > expected && !budget_reached && !spent() && next != m_chunks.end()) {
+			auto found = next++;
+
+			int chunk_id = found->first;
+			auto chunk = found->second;
+			int lane = lane_of(chunk_id);
+
+			int missing = m_lanes[lane].missing_chunk;
+			if (stalled[lane] || (missing >= 0 && chunk_id >= missing)) {
+				// lane is stopped at its missing chunk, or waits for one of its chunks
+				continue;
+			}
+
+			int want = request->num - expected;
+			if (quoted) {
+				want = std::min(want, quotas[lane]);
+				if (want <= 0) {
+					continue;
+				}
+			}
+
+			if (!chunk->loaded()) {
+				load_now(chunk);
+				waiting = true;
+				stalled[lane] = true;
+				continue;
+			}
+
+			// Chunk with entries given out and not acked yet is popped as usual
+			// (its expired entries are acked one by one), as their acks, extends
+			// and timeouts still need the chunk.
+			if (!is_push_chunk(chunk_id) && !m_wait_ack.count(chunk_id) && chunk->meta().expired(now_s)) {
+				LOG_INFO("%s, chunk %d expired, dropped with %d entries not acked", m_queue_id.c_str(), chunk_id,
+						chunk->meta().high_mark() - chunk->meta().acked());
+				m_statistics.expire_count += chunk->meta().high_mark() - chunk->meta().acked();
+
+				m_chunks.erase(found);
+				dropped.push_back(chunk);
+				continue;
+			}
+
+			data_array d = chunk->pop(want, request->max_bytes ? request->max_bytes - request->bytes : 0);
+			take_expired(chunk);
+			if (d.empty() && chunk->budget_reached() && request->entries.empty()) {
+				// budget is smaller than the very first entry
+				d = chunk->pop(1);
+				take_expired(chunk);
+			}
+			d = check_attempts(chunk, d);
+			budget_reached = chunk->budget_reached();
+			cache_touch(chunk);
+			// first chunk of the lane reads ahead
+			if (found == m_chunks.begin() || lane_of(std::prev(found)->first) != lane) {
+				read_ahead(found);
+			}
+			if (quoted) {
+				quotas[lane] -= d.sizes().size();
+			}
+			LOG_INFO("%s, chunk %d, popping %d entries", m_queue_id.c_str(), chunk_id, d.sizes().size());
+			//DEBUG
+			for (const auto &i : d.ids()) {
+				LOG_INFO("%s, chunk %d, pos %d, state %d", m_queue_id.c_str(), i.chunk, i.pos, chunk->meta()[i.pos].state);
+			}
+
+			if (!d.empty()) {
+				m_statistics.pop_count += d.sizes().size();
+
+				request->entries.extend(d);
+				request->num -= d.sizes().size();
+				request->bytes += d.data().size();
+
+				m_wait_ack.insert({chunk_id, chunk});
+				for (const auto &i : d.ids()) {
+					start_timeout(i, now);
+				}
+			}
+
+			if (chunk->data_wanted()) {
+				fetch(chunk);
+				waiting = true;
+				// entries published but not popped yet (none are counted for a replaying chunk,
+				// which only means one more read could be issued)
+				int coming = std::max(chunk->meta().high_mark() - chunk->meta().low_mark(), 1);
+				if (quoted) {
+					coming = std::min(coming, quotas[lane]);
+					quotas[lane] -= coming;
+				}
+				expected += coming;
+				continue;
+			}
+
+			if (is_push_chunk(chunk_id)) {
+				// lane is drained, next lane goes on
+				continue;
+			}
+
+			if (chunk->expect_no_more()) {
+				//FIXME: this could happen to be called many times for the same chunk
+				// (between queue restarts or because of chunk replaying)
+				chunk->add(&m_statistics.chunks_popped);
+
+				LOG_INFO("%s, chunk %d exhausted, dropped from the popping line", m_queue_id.c_str(), chunk_id);
+
+				// drop chunk from the pop list
+				m_chunks.erase(found);
+				if (m_wait_ack.find(chunk_id) == m_wait_ack.end()) {
+					cache_forget(chunk_id);
+				}
+
+			} else if (d.empty() && !chunk->meta().expiring()) {
+				// this is error condition: middle chunk must give some data but gives none
+				stalled[lane] = true;
+			}
+		}
+	}
+
+	if (!expired.empty()) {
+		ack(entry_range::from_ids(expired));
+	}
+	if (!dropped.empty()) {
+		// state goes before removal, as with acked chunks
+		update_ack_state();
+		for (const auto &chunk : dropped) {
+			chunk->add(&m_statistics.chunks_popped);
+			chunk->remove();
+			cache_forget(chunk->id());
+		}
+	}
+
+	// Whatever is already at hand is replied at once,
+	// empty reply waits for the storage (if there is anything to wait for).
+	// Long poll waits for new entries until its batch is worth sending.
+	bool full = request->num <= 0 || budget_reached || spent();
+	bool lingering = now < request->deadline && !full && (int)request->entries.sizes().size() < request->min_entries;
+	if ((waiting && wait && request->entries.empty()) || lingering) {
+		if (request->deadline) {
+			schedule(request->deadline);
+		}
+		if (!request->entries.empty()) {
+			request->held = true;
+		}
+		return false;
+	}
+
+	if (request->held) {
+		// consumer gets its full ack wait time from now
+		for (const auto &i : request->entries.ids()) {
+			start_timeout(i, now);
+		}
+	}
+
+	request->handler(request->entries);
+	return true;
+}
+
+void queue::resume_peeks(bool wait)
+{
+	std::deque<std::shared_ptr<peek_request>> waiting;
+	waiting.swap(m_peek_waiting);
+
+	for (const auto &request : waiting) {
+		if (!serve_peek(request, wait)) {
+			m_peek_waiting.push_back(request);
+		}
+	}
+}
+
+void queue::expire_peeks(uint64_t now)
+{
+	uint64_t next = 0;
+	bool expired = false;
+
+	for (const auto &request : m_peek_waiting) {
+		if (!request->deadline) {
+			continue;
+		}
+		if (request->deadline <= now) {
+			expired = true;
+		} else if (next == 0 || request->deadline < next) {
+			next = request->deadline;
+		}
+	}
+
+	if (expired) {
+		// expired ones are replied, others are parked again
+		resume_peeks(true);
+	} else if (next) {
+		schedule(next);
+	}
+}
+
+void queue::ack(const std::vector<entry_id> &ids)
+{
+	// Ids are grouped by chunk and packed into runs,
+	// so every chunk gets its acks in one pass
+	std::vector<entry_id> sorted(ids);
+	std::sort(sorted.begin(), sorted.end(), [] (const entry_id &a, const entry_id &b) {
+		return a.chunk < b.chunk || (a.chunk == b.chunk && a.pos < b.pos);
+	});
+
+	ack(entry_range::from_ids(sorted));
+}
+
+void queue::ack(const std::vector<entry_range> &ranges)
+{
+	std::unordered_set<shared_chunk> affected_chunks;
+	// chunks with all popped entries acked
+	std::vector<shared_chunk> finished;
+
+	for (const auto &range : ranges) {
+		auto found = m_wait_ack.find(range.chunk);
+		if (found == m_wait_ack.end()) {
+			LOG_ERROR("%s, ack for chunk %d (pos %d-%d) which is not in waiting list", m_queue_id.c_str(), range.chunk, range.from, range.to);
+			continue;
+		}
+		auto chunk = found->second;
+
+		// only popped entries could be acked
+		int32_t to = std::min(range.to, chunk->meta().low_mark() - 1);
+		if (range.from < 0 || range.from > to) {
+			LOG_ERROR("%s, ack for chunk %d, pos %d-%d which are not popped, low %d", m_queue_id.c_str(),
+					range.chunk, range.from, range.to, chunk->meta().low_mark());
+			continue;
+		}
+
+		LOG_INFO("%s, ack, chunk %d, pos %d-%d", m_queue_id.c_str(), range.chunk, range.from, to);
+		if (!m_deadlines.empty()) {
+			for (int32_t pos = range.from; pos <= to; ++pos) {
+				stop_timeout(entry_id{range.chunk, pos});
+			}
+		}
+		m_statistics.ack_count += chunk->ack_range(range.from, to);
+		affected_chunks.insert(chunk);
+
+		if (chunk->meta().acked() == chunk->meta().low_mark()) {
+			// Real end of the chunk's lifespan, all popped entries are acked
+			m_wait_ack.erase(found);
+			chunk->add(&m_statistics.chunks_popped);
+			finished.push_back(chunk);
+		}
+	}
+
+	if (!finished.empty()) {
+		// state is updated once per call, and it goes before any chunk removal
+		update_ack_state();
+
+		// Chunk would be uncomplete here only if its the only chunk in the queue
+		// (filled partially and serving both as a push and a pop/ack target)
+		for (const auto &chunk : finished) {
+			if (chunk->meta().complete()) {
+				chunk->remove();
+				cache_forget(chunk->id());
+				affected_chunks.erase(chunk);
+				LOG_INFO("%s, ack, chunk %d complete", m_queue_id.c_str(), chunk->id());
+			}
+		}
+	}
+
+	// journal appends (and the state write) go out in parallel
+	for (const auto &chunk : affected_chunks) {
+		write_journal(chunk);
+	}
+}
+
+void queue::ack_upto(const entry_id &id)
+{
+	// every popped entry of the chunks below (of the same lane)
+	// and of the chunk itself up to the position
+	std::vector<entry_range> ranges;
+	for (auto i = m_wait_ack.lower_bound(lane_base(lane_of(id.chunk))); i != m_wait_ack.end(); ++i) {
+		if (i->first > id.chunk) {
+			break;
+		}
+
+		int32_t to = i->second->meta().low_mark() - 1;
+		if (i->first == id.chunk) {
+			to = std::min(to, id.pos);
+		}
+		if (to >= 0) {
+			ranges.push_back(entry_range{i->first, 0, to});
+		}
+	}
+
+	ack(ranges);
+}
+
+void queue::extend(const std::vector<entry_range> &ranges, uint64_t time)
+{
+	uint64_t now = microseconds_now();
+	uint64_t deadline = now + (time ? time : m_ack_wait_timeout);
+	size_t count = 0;
+
+	for (const auto &range : ranges) {
+		auto chunk = m_wait_ack.find(range.chunk);
+		if (chunk == m_wait_ack.end()) {
+			LOG_ERROR("%s, extend for chunk %d (pos %d-%d) which is not in waiting list", m_queue_id.c_str(), range.chunk, range.from, range.to);
+			continue;
+		}
+
+		// only popped entries have deadlines
+		int32_t to = std::min(range.to, chunk->second->meta().low_mark() - 1);
+		for (int32_t pos = std::max(range.from, 0); pos <= to; ++pos) {
+			entry_id id = {range.chunk, pos};
+
+			// only entries which are with consumers now, nacked ones are not
+			auto found = m_deadlines.find(entry_key(id));
+			if (found == m_deadlines.end() || (!m_nack_delayed.empty() && m_nack_delayed.count(entry_key(id)))) {
+				continue;
+			}
+
+			// previous timer becomes stale
+			found->second = deadline;
+			m_timeouts->add(now, deadline, id);
+			++count;
+		}
+	}
+
+	LOG_INFO("%s, extended %ld entries by %lld us", m_queue_id.c_str(), count, deadline - now);
+}
+
+void queue::nack(const std::vector<entry_id> &ids, uint64_t delay)
+{
+	uint64_t now = microseconds_now();
+	size_t count = 0;
+
+	// in reverse order, so that nacked entries keep their order at the front of the line
+	for (auto i = ids.rbegin(); i != ids.rend(); ++i) {
+		const entry_id &id = *i;
+
+		// only entries given out and waiting for an ack could be nacked
+		// (not acked, not timed out yet)
+		if (m_deadlines.find(entry_key(id)) == m_deadlines.end()) {
+			LOG_ERROR("%s, nack for entry %d-%d which is not waiting for an ack", m_queue_id.c_str(), id.chunk, id.pos);
+			continue;
+		}
+
+		if (delay) {
+			// entry's ack deadline becomes the end of the delay
+			uint64_t deadline = now + delay;
+			m_deadlines[entry_key(id)] = deadline;
+			m_timeouts->add(now, deadline, id);
+			m_nack_delayed.insert(entry_key(id));
+			schedule(deadline);
+		} else {
+			stop_timeout(id);
+			m_redeliver.push_front(id);
+		}
+
+		++count;
+	}
+
+	LOG_INFO("%s, nacked %ld entries, delay %lld us", m_queue_id.c_str(), count, delay);
+	m_statistics.nack_count += count;
+
+	if (count && !delay) {
+		// waiting peeks (long polls) get them right away
+		resume_peeks(true);
+	}
+}
+
+void queue::write_journal(const shared_chunk &chunk)
+{
+	if (!chunk->fold_needed()) {
+		chunk->write_journal();
+		return;
+	}
+
+	// Journal is folded into the base meta in two steps: base meta is written,
+	// then the journal is removed. Records made meanwhile wait inside the chunk.
+	++m_io_inflight;
+
+	chunk->fold_journal().connect(ioremap::elliptics::async_write_result::result_function(),
+		[this, chunk] (const ioremap::elliptics::error_info &error) {
+			auto guard = lock();
+
+			if (!chunk->fold_written(error)) {
+				--m_io_inflight;
+				m_timer_condition.notify_all();
+				return;
+			}
+
+			chunk->remove_journal().connect(ioremap::elliptics::async_remove_result::result_function(),
+				[this, chunk] (const ioremap::elliptics::error_info &error) {
+					auto guard = lock();
+
+					--m_io_inflight;
+					chunk->fold_complete(error);
+
+					m_timer_condition.notify_all();
+				}
+			);
+		}
+	);
+}
+
+void queue::reply(cocaine::framework::response_ptr response, const ioremap::elliptics::exec_context &context,
+		const ioremap::elliptics::argument_data &d, ioremap::elliptics::exec_context::final_state state)
+{
+	m_reply_client->reply(context, d, state).connect(
+		ioremap::elliptics::async_reply_result::result_function(),
+		[this, response] (const ioremap::elliptics::error_info &error) {
+			if (error) {
+				LOG_ERROR("%s, reply error: %s", m_queue_id.c_str(), error.message().c_str());
+			} else {
+				//LOG_INFO("%s, replied", m_queue_id.c_str());
+			}
+		}
+	);
+}
+
+void queue::final(cocaine::framework::response_ptr response, const ioremap::elliptics::exec_context &context, const ioremap::elliptics::argument_data &d)
+{
+	reply(response, context, d, ioremap::elliptics::exec_context::final);
 }
 
 const std::string &queue::queue_id() const
@@ -505,9 +2054,14 @@ const std::string &queue::queue_id() const
 	return m_queue_id;
 }
 
-const queue_state &queue::state()
+int queue::lanes() const
+{
+	return m_lanes.size();
+}
+
+const queue_state &queue::state(int lane)
 {
-	return m_state;
+	return m_lanes[lane].state;
 }
 
 const queue_statistics &queue::statistics()
@@ -2,6 +2,14 @@
 #define __QUEUE_HPP
 
 #include <map>
+#include <set>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #include <elliptics/session.hpp>
 
@@ -13,6 +21,7 @@
 #include <grape/entry_id.hpp>
 
 #include "chunk.hpp"
+#include "timer_wheel.hpp"
 
 namespace ioremap { namespace grape {
 
@@ -25,32 +34,157 @@ struct queue_statistics {
 	uint64_t push_count;
 	uint64_t pop_count;
 	uint64_t ack_count;
+	uint64_t nack_count;
 	uint64_t timeout_count;
+	uint64_t dead_letter_count;
+	uint64_t delay_count;
+	uint64_t promote_count;
+	uint64_t expire_count;
 
 	uint64_t state_write_count;
 
+	uint64_t cache_evict_count;
+
 	chunk_stat chunks_popped;
 	chunk_stat chunks_pushed;
 };
 
+// Pushes gathered within the linger window, written to the storage as a whole
+struct push_group {
+	std::string data;
+	std::vector<int> sizes;
+	// expiry times of entries (seconds since epoch), empty if none expires
+	std::vector<uint32_t> expires;
+	std::vector<std::function<void (const elliptics::error_info &)>> handlers;
+	uint64_t deadline;
+
+	push_group() : deadline(0) {}
+};
+
+// Entries to be written to the storage in one go (split only at chunk boundaries)
+struct push_batch {
+	int lane;
+	// delay bucket the entries go to (milliseconds since epoch), 0 - entries go to the lane
+	int64_t due;
+	elliptics::data_pointer data;
+	std::vector<int> sizes;
+	std::vector<uint32_t> expires;
+	std::function<void (const elliptics::error_info &)> handler;
+	// called before @handler with the number of leading entries written (may be empty)
+	std::function<void (size_t)> progress;
+};
+
+// Priority lane: chunk sequence with its own state object and push group.
+// Lane's chunk ids start at lane * LANE_CHUNKS, so chunks of all lanes
+// share one id space ordered by lane, lane 0 is the highest priority.
+struct queue_lane {
+	static const int LANE_CHUNKS = 1 << 24;
+	// chunk ids of all lanes fit into int
+	static const int MAX_LANES = 127;
+
+	queue_state state;
+	std::string state_id;
+	push_group group;
+	// weighted ratio: lane's weight and its score in smooth weighted round robin
+	int weight;
+	int64_t score;
+	// middle chunk which has no meta (-1 if none), lane is not served from it on
+	int missing_chunk;
+};
+
+// Chunk of entries pushed with a delay, its entries are pushed
+// to the lane once @due (milliseconds since epoch) comes
+struct delayed_chunk {
+	int chunk_id;
+	int64_t due;
+	int lane;
+	// entries before this position are already pushed to the lane
+	int promoted;
+
+	MSGPACK_DEFINE(chunk_id, due, lane, promoted);
+};
+
+// State object of delayed chunks, rewritten whenever one is added or promoted
+struct delayed_state {
+	int chunk_id_next;
+	std::vector<delayed_chunk> chunks;
+
+	MSGPACK_DEFINE(chunk_id_next, chunks);
+};
+
+// Peek waiting for chunk data or meta to be read from the storage
+struct peek_request {
+	int num;
+	// byte budget of the reply (0 is no limit) and bytes gathered
+	uint64_t max_bytes;
+	uint64_t bytes;
+	// Long poll: reply is held until @min_entries are gathered
+	// or until @deadline (in microseconds, 0 is no long poll)
+	uint64_t deadline;
+	int min_entries;
+	// entries were held, their ack deadlines are to be set anew on reply
+	bool held;
+	data_array entries;
+	std::function<void (const data_array &)> handler;
+};
+
 class queue {
 	public:
 		ELLIPTICS_DISABLE_COPY(queue);
 
+		// Called when pushed entry is written to the storage
+		typedef std::function<void (const elliptics::error_info &)> push_handler;
+		// Called with peeked entries (possibly none), peek never waits for the storage
+		// in place, the handler is called when entries are read
+		typedef std::function<void (const data_array &)> peek_handler;
+
 		queue(const std::string &queue_id);
+		~queue();
 
 		void initialize(const std::string &config);
 
+		// Queue is shared between event handlers and internal timer thread,
+		// every external call must be made under this lock
+		std::unique_lock<std::recursive_mutex> lock();
+
 		// single entry methods
-		void push(const elliptics::data_pointer &d);
-		elliptics::data_pointer peek(entry_id *entry_id);
+		// @priority is the lane to push to, priorities beyond the lowest lane go to it,
+		// entry expires after the queue's ttl
+		void push(const elliptics::data_pointer &d, const push_handler &handler = push_handler(), int priority = 0);
 		void ack(const entry_id id);
-		elliptics::data_pointer pop();
 
 		// multiple entries methods
-		data_array peek(int num);
+		// Entries expire @ttl seconds after the push (0 is the queue's ttl),
+		// expired entries are acked without being given out
+		void push(const data_array &d, const push_handler &handler = push_handler(), int priority = 0, int ttl = 0);
+		// Delayed push: entries are stored aside and become visible to peek
+		// at @deliver_at (milliseconds since epoch, rounded up to the delay bucket),
+		// entries which are due already are pushed as usual.
+		// Entries' @ttl is counted from @deliver_at.
+		void push_delayed(const data_array &d, int64_t deliver_at, const push_handler &handler = push_handler(), int priority = 0,
+				int ttl = 0);
+		// Peeks up to @num entries taking up to @max_bytes (0 is no limit),
+		// first entry is given out even if it alone is over the limit.
+		// With @wait_time (in microseconds, capped by ack wait timeout) reply is held
+		// until at least @min_entries are available or until the time passes.
+		void peek(int num, uint64_t max_bytes, uint64_t wait_time, int min_entries, const peek_handler &handler);
 		void ack(const std::vector<entry_id> &ids);
-		data_array pop(int num);
+		// Acks runs of entries in bulk, every chunk's acks make a single journal append
+		// and the state is written at most once per call
+		void ack(const std::vector<entry_range> &ranges);
+		// Cumulative ack: acks every popped entry of @id's lane up to @id (inclusive),
+		// meant for a single consumer which processes entries in order
+		void ack_upto(const entry_id &id);
+
+		// Pushes ack deadlines of given out entries to @time (in microseconds,
+		// 0 is ack wait timeout) from now, for consumers which process entries long
+		void extend(const std::vector<entry_range> &ranges, uint64_t time);
+
+		// Negative acks: entries go back to the front of the delivery line
+		// at once or after @delay (in microseconds)
+		void nack(const std::vector<entry_id> &ids, uint64_t delay);
+		// peek and ack in one go
+		void pop(int num, uint64_t max_bytes, uint64_t wait_time, int min_entries, const peek_handler &handler);
 
 		// content manipulation
 		void clear();
@@ -61,14 +195,38 @@ class queue {
 		void final(cocaine::framework::response_ptr response, const ioremap::elliptics::exec_context &context, const ioremap::elliptics::argument_data &d);
 
 		const std::string &queue_id() const;
-		const queue_state &state();
+		int lanes() const;
+		const queue_state &state(int lane = 0);
+		// middle chunk of the lane found without meta, -1 if none
+		int missing_chunk(int lane) const;
 		const queue_statistics &statistics();
 		void clear_counters();
 
+		// resident bytes of chunk data caches, by chunk id
+		std::map<int, uint64_t> cache_usage() const;
+
 	private:
 		int m_chunk_max;
+		// storage operations time out in that many seconds
+		int m_wait_timeout;
 		uint64_t m_ack_wait_timeout;
-		uint64_t m_timeout_check_period;
+		uint64_t m_timeout_tick;
+		uint64_t m_push_linger_time;
+		uint64_t m_push_linger_bytes;
+		int m_push_inflight_max;
+		int m_journal_max;
+		int m_read_ahead;
+		uint64_t m_cache_max;
+		int m_load_parallel;
+		// entry delivered this many times (0 is no limit) goes to the dead-letter queue
+		int m_max_deliveries;
+		std::string m_dead_letter_queue;
+		// middle chunk without meta is skipped (its entries are lost) instead of stopping its lane
+		bool m_skip_missing_chunks;
+		// granularity of delivery times of delayed entries, in milliseconds
+		int64_t m_delay_bucket;
+		// entries expire this many seconds after the push, 0 is never
+		int m_ttl;
 
 		std::string m_queue_id;
 		std::string m_queue_state_id;
@@ -77,18 +235,156 @@ class queue {
 		std::shared_ptr<elliptics::session> m_reply_client;
 		std::shared_ptr<elliptics::session> m_data_client;
 
-		queue_state m_state;
+		// Priority lanes, peek serves them by strict priority or,
+		// if lanes have weights, shares every batch by weighted ratio
+		std::vector<queue_lane> m_lanes;
+		bool m_lanes_weighted;
 		queue_statistics m_statistics;
 
 		std::map<int, shared_chunk> m_chunks;
 		std::map<int, shared_chunk> m_wait_ack;
-		uint64_t m_last_timeout_check_time;
 
-		void write_state();
+		// Ack deadlines of popped entries, keyed by entry_key().
+		// Wheel keeps every deadline ever set, only ones still matching
+		// this map are actual (entry could be acked or redelivered since).
+		std::unordered_map<uint64_t, uint64_t> m_deadlines;
+		std::unique_ptr<timer_wheel<entry_id>> m_timeouts;
+		// timed out entries, given out by peek before any new ones
+		std::deque<entry_id> m_redeliver;
+		// entries nacked with a delay (their deadlines are the ends of the delays)
+		std::unordered_set<uint64_t> m_nack_delayed;
+
+		// appends in flight and batches waiting for a free slot in the in-flight window
+		int m_push_inflight;
+		std::deque<push_batch> m_push_backlog;
+
+		// data reads and journal folds in flight
+		int m_io_inflight;
+
+		// chunks waiting to be loaded in background, in pop order, and loads in flight
+		std::deque<shared_chunk> m_load_line;
+		std::set<int> m_loading;
+		// failed loads of chunks, in a row
+		std::map<int, int> m_load_failures;
+
+		// peeks waiting for the storage or for new entries (long polls)
+		std::deque<std::shared_ptr<peek_request>> m_peek_waiting;
+
+		// Delayed chunks live in a chunk id space of their own (under m_delayed_id).
+		// Every one has a timer for its due time, chunks being promoted
+		// are in m_promoting, chunks taking pushes are open by bucket and lane.
+		std::string m_delayed_id;
+		std::string m_delayed_state_id;
+		int m_delayed_chunk_next;
+		std::map<int, delayed_chunk> m_delayed;
+		std::map<int, shared_chunk> m_delayed_chunks;
+		std::map<std::pair<int64_t, int>, int> m_delayed_open;
+		std::set<int> m_promoting;
+		std::unique_ptr<timer_wheel<int>> m_delay_timers;
+
+		// Chunks with data in cache, most recently used first.
+		// Total is kept within m_cache_max by dropping caches of the least recently used ones.
+		struct cache_entry {
+			shared_chunk chunk;
+			uint64_t bytes;
+		};
+		std::list<cache_entry> m_cache;
+		std::unordered_map<int, std::list<cache_entry>::iterator> m_cache_index;
+		uint64_t m_cache_bytes;
+
+		std::recursive_mutex m_mutex;
+		std::condition_variable_any m_timer_condition;
+		std::thread m_timer_thread;
+		uint64_t m_timer_wakeup;
+		bool m_timer_stop;
+
+		void write_state(int lane);
+
+		void push_entries(int lane, const elliptics::data_pointer &d, const std::vector<int> &sizes,
+				const std::vector<uint32_t> &expires, const push_handler &handler, int64_t due = 0,
+				const std::function<void (size_t)> &progress = std::function<void (size_t)>());
+		// expiry time (seconds since epoch, 0 is never) of entries pushed
+		// with @ttl (0 is the queue's one) to be delivered at @deliver_at (milliseconds since epoch)
+		uint32_t expire_time(int ttl, int64_t deliver_at) const;
+		void write_entries(const push_batch &batch);
+		// batch has to wait: its chunk is rolling back failed writes
+		bool push_stalled(const push_batch &batch);
+		// flushes push groups of all lanes or of the given one
+		void flush_pushes();
+		void flush_pushes(int lane);
+		void flush_push_backlog();
+		// batches waiting for a write slot are dropped, their producers get @error
+		void fail_push_backlog(const elliptics::error_info &error);
+
+		// schedules timer thread to wake up at @time (in microseconds)
+		void schedule(uint64_t time);
+		void timer_loop();
+		void on_timer(uint64_t now);
+
+		int push_lane(int priority) const;
+		shared_chunk push_chunk(int lane);
+		void push_chunk_filled(shared_chunk chunk);
+		bool is_push_chunk(int chunk_id) const;
+
+		// accounts chunk's cache after its use (and evicts others if over the budget)
+		void cache_touch(const shared_chunk &chunk);
+		void cache_forget(int chunk_id);
+
+		// issues background loads of chunks from the load line
+		void load_chunks();
+		// loads popping chunk ahead of others if background load has not got to it yet
+		void load_now(const shared_chunk &chunk);
+		// reads chunk's meta and journal and loads them, @handler gets
+		// if the chunk has meta at all and if the load succeeded
+		void load_chunk(const shared_chunk &chunk, const std::function<void (bool found, bool ok)> &handler);
+		void chunk_missing(int chunk_id);
+
+		// Gathers entries for the peek, false if it has to wait for the storage
+		// (only if @wait is set and nothing is gathered yet)
+		bool serve_peek(const std::shared_ptr<peek_request> &request, bool wait);
+		// serves waiting peeks again once something is read or pushed
+		void resume_peeks(bool wait);
+		// replies long polls which have reached their deadlines
+		void expire_peeks(uint64_t now);
+		// starts reading chunk's data not in cache yet
+		void fetch(const shared_chunk &chunk);
+
+		// appends chunk's journal records or folds the journal
+		void write_journal(const shared_chunk &chunk);
+
+		void write_delayed_state();
+		// chunk taking delayed pushes of the bucket
+		shared_chunk delay_chunk(int64_t due, int lane);
+		void schedule_promotion(const delayed_chunk &record, uint64_t now);
+		void expire_delays(uint64_t now);
+		// Promotion: delayed chunk is loaded, its data is read and entries are pushed
+		// to the lane, then the chunk is removed. Failed promotion is tried again
+		// (entries pushed by a partially failed one could be pushed twice).
+		void promote(int chunk_id);
+		void promote_read(int chunk_id, const shared_chunk &chunk);
+		void promote_push(int chunk_id, const shared_chunk &chunk);
+		void promote_failed(int chunk_id);
+
+		// starts reading data of the chunk next to @current when @current is close to exhaustion
+		void read_ahead(std::map<int, shared_chunk>::iterator current);
 
-		void update_chunk_timeout(int chunk_id, shared_chunk chunk);
+		// recomputes chunk_id_ack of every lane and writes the states which are changed
+		void update_ack_state();
+		// splits @num entries among lanes by their weights
+		std::vector<int> lane_quotas(int num);
 
-		void check_timeouts();
+		// sets (or resets) ack deadline of the delivered entry
+		void start_timeout(const entry_id &id, uint64_t now);
+		void stop_timeout(const entry_id &id);
+		void expire_timeouts(uint64_t now);
+		// entry bigger than @max_bytes (0 is no limit) is left for the next peek,
+		// @attempts is set to the entry's delivery attempt
+		bool redeliver(entry_id *id, elliptics::data_pointer *d, uint64_t max_bytes, int *attempts);
+		// Entries popped again after restart count one more attempt, those which are
+		// over max-deliveries go to the dead-letter queue, the rest are returned
+		data_array check_attempts(const shared_chunk &chunk, const data_array &d);
+		// pushes entry (given out @attempts times) to the dead-letter queue and acks it once the push is done
+		void dead_letter(const entry_id &id, int attempts, const elliptics::data_pointer &d);
 };
 
 }} // namespace ioremap::grape
@@ -0,0 +1,156 @@
+#ifndef __TIMER_WHEEL_HPP
+#define __TIMER_WHEEL_HPP
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+namespace ioremap { namespace grape {
+
+// Hierarchical timer wheel.
+//
+// Deadlines (in microseconds) are kept with @tick granularity in LEVELS wheels
+// of SLOTS slots each, every next wheel being SLOTS times coarser than previous.
+// Adding a timer and firing it are O(1), timer moves down to a finer wheel
+// at most LEVELS - 1 times in its life.
+//
+// Timers are never removed: owner is expected to check if fired timer
+// is still actual (for example, by comparing its deadline with the current one).
+template <class T>
+class timer_wheel {
+	public:
+		static const int LEVELS = 4;
+		static const int SLOT_BITS = 8;
+		static const uint64_t SLOTS = 1 << SLOT_BITS;
+
+		timer_wheel(uint64_t tick)
+			: m_tick(tick)
+			, m_current(0)
+			, m_size(0)
+		{
+			for (int l = 0; l < LEVELS; ++l) {
+				m_slots[l].resize(SLOTS);
+			}
+		}
+
+		// Adds timer with @deadline, @now is a current time
+		void add(uint64_t now, uint64_t deadline, const T &item) {
+			if (m_size == 0 && m_current < now / m_tick) {
+				m_current = now / m_tick;
+			}
+			place(deadline, item, false);
+			++m_size;
+		}
+
+		// Fires all timers with deadline before @now (up to tick granularity),
+		// @fire is called as fire(item, deadline)
+		template <class F>
+		void advance(uint64_t now, F fire) {
+			uint64_t target = now / m_tick;
+
+			while (m_current < target && m_size > 0) {
+				++m_current;
+
+				// timers of the coarser wheel's slot are spread over finer wheels
+				// every time finer wheel makes its full turn
+				for (int l = 1; l < LEVELS; ++l) {
+					if (m_current & ((1ULL << (SLOT_BITS * l)) - 1)) {
+						break;
+					}
+					cascade(l, (m_current >> (SLOT_BITS * l)) & (SLOTS - 1));
+				}
+
+				slot_type expired;
+				expired.swap(m_slots[0][m_current & (SLOTS - 1)]);
+				m_size -= expired.size();
+
+				for (const auto &timer : expired) {
+					fire(timer.second, timer.first);
+				}
+			}
+
+			if (m_current < target) {
+				m_current = target;
+			}
+		}
+
+		// Time (in microseconds) the wheel should be advanced at, 0 if there are no timers
+		uint64_t next_time() const {
+			if (m_size == 0) {
+				return 0;
+			}
+
+			for (uint64_t t = m_current + 1; t <= m_current + SLOTS; ++t) {
+				if (!m_slots[0][t & (SLOTS - 1)].empty()) {
+					return t * m_tick;
+				}
+			}
+
+			// nothing in the finest wheel, wake up when coarser one is to be cascaded
+			return ((m_current | (SLOTS - 1)) + 1) * m_tick;
+		}
+
+		size_t size() const {
+			return m_size;
+		}
+
+		bool empty() const {
+			return m_size == 0;
+		}
+
+		void clear() {
+			for (int l = 0; l < LEVELS; ++l) {
+				for (auto &slot : m_slots[l]) {
+					slot.clear();
+				}
+			}
+			m_size = 0;
+		}
+
+	private:
+		typedef std::vector<std::pair<uint64_t, T>> slot_type;
+
+		uint64_t m_tick;
+		// ticks since epoch the wheel is advanced to
+		uint64_t m_current;
+		size_t m_size;
+
+		std::vector<slot_type> m_slots[LEVELS];
+
+		void place(uint64_t deadline, const T &item, bool cascading) {
+			uint64_t t = deadline / m_tick;
+
+			// Overdue timers fire on the next tick, but while cascading
+			// current tick's slot is not fired yet and could be used.
+			if (t < m_current || (t == m_current && !cascading)) {
+				t = m_current + 1;
+			}
+
+			uint64_t diff = t - m_current;
+			int level = 0;
+			while (level < LEVELS - 1 && diff >= (1ULL << (SLOT_BITS * (level + 1)))) {
+				++level;
+			}
+
+			// too far in the future, park it in the coarsest wheel's farthest slot,
+			// it will be placed anew when that slot is cascaded
+			if (diff >= (1ULL << (SLOT_BITS * LEVELS))) {
+				t = m_current + (1ULL << (SLOT_BITS * LEVELS)) - 1;
+			}
+
+			m_slots[level][(t >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(std::make_pair(deadline, item));
+		}
+
+		void cascade(int level, uint64_t index) {
+			slot_type timers;
+			timers.swap(m_slots[level][index]);
+
+			for (const auto &timer : timers) {
+				place(timer.first, timer.second, true);
+			}
+		}
+};
+
+}} // namespace ioremap::grape
+
+#endif /* __TIMER_WHEEL_HPP */
@@ -34,7 +34,76 @@ public:
 };
 
 TEST_F(ChunkMeta, CheckConstructedMetaSize) {
-	ASSERT_EQ(meta.data().size(), sizeof(ioremap::grape::chunk_disk) + meta_size * sizeof(ioremap::grape::chunk_entry));
+	ASSERT_EQ(meta.data().size(), sizeof(ioremap::grape::chunk_disk_header));
+}
+
+TEST_F(ChunkMeta, CheckMetaSizeGrowsWithPushes) {
+	for (int i = 0; i < 3; ++i) {
+		meta.push(100);
+	}
+	// one byte per size, one byte of ack bitmap
+	ASSERT_EQ(meta.data().size(), sizeof(ioremap::grape::chunk_disk_header) + 3 + 1);
+
+	meta.push(100000);
+	ASSERT_EQ(meta.data().size(), sizeof(ioremap::grape::chunk_disk_header) + 4 * 4 + 1);
+}
+
+TEST_F(ChunkMeta, CheckMetaRoundTrip) {
+	for (int i = 0; i < meta_size; ++i) {
+		meta.push(chunk_sizes[i] * 1000);
+	}
+	for (int i = 0; i < meta_size / 2; ++i) {
+		meta.pop();
+	}
+	for (int i = 0; i < meta_size / 2; i += 3) {
+		meta.ack(i, ioremap::grape::chunk_entry::STATE_ACKED);
+	}
+	meta.seal();
+
+	std::string blob = meta.data();
+	ioremap::grape::chunk_meta copy(1);
+	copy.assign((char *)blob.data(), blob.size());
+
+	ASSERT_EQ(copy.max(), meta.max());
+	ASSERT_EQ(copy.low_mark(), meta.low_mark());
+	ASSERT_EQ(copy.high_mark(), meta.high_mark());
+	ASSERT_EQ(copy.acked(), meta.acked());
+	for (int i = 0; i < meta_size; ++i) {
+		ASSERT_EQ(copy[i].size, meta[i].size);
+		ASSERT_EQ(copy[i].state, meta[i].state);
+	}
+}
+
+TEST_F(ChunkMeta, CheckLegacyMetaIsReadable) {
+	const int pushed = 10;
+
+	std::string blob(sizeof(ioremap::grape::chunk_disk) + meta_size * sizeof(ioremap::grape::chunk_entry), 0);
+	ioremap::grape::chunk_disk *disk = (ioremap::grape::chunk_disk *)blob.data();
+	disk->max = meta_size;
+	disk->low = 5;
+	disk->high = pushed;
+	disk->acked = 1;
+	for (int i = 0; i < pushed; ++i) {
+		disk->entries[i].size = chunk_sizes[i];
+	}
+	disk->entries[2].state = ioremap::grape::chunk_entry::STATE_ACKED;
+
+	meta.assign((char *)blob.data(), blob.size());
+
+	ASSERT_EQ(meta.max(), disk->max);
+	ASSERT_EQ(meta.low_mark(), 5);
+	ASSERT_EQ(meta.high_mark(), pushed);
+	ASSERT_EQ(meta.acked(), 1);
+	for (int i = 0; i < pushed; ++i) {
+		ASSERT_EQ(meta[i].size, chunk_sizes[i]);
+		ASSERT_EQ(meta[i].state == ioremap::grape::chunk_entry::STATE_ACKED, i == 2);
+	}
+}
+
+TEST_F(ChunkMeta, CheckAssignThrowsOnBadSize) {
+	std::string blob = meta.data();
+	blob.push_back(0);
+	ASSERT_THROW(meta.assign((char *)blob.data(), blob.size()), ioremap::elliptics::error);
 }
 
 TEST_F(ChunkMeta, CheckMetaPushesCorrectSizes) {
@@ -136,3 +205,385 @@ TEST_F(ChunkMeta, CheckAckNoThrowOnAckedMeta) {
 		ASSERT_NO_THROW(meta.ack(i, ioremap::grape::chunk_entry::STATE_ACKED));
 	}
 }
+
+TEST_F(ChunkMeta, CheckJournalReplayRestoresMeta) {
+	for (int i = 0; i < meta_size; ++i) {
+		ASSERT_TRUE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::PUSH, i, chunk_sizes[i]}));
+	}
+	ASSERT_TRUE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::ACK, 10, 0}));
+
+	ASSERT_TRUE(meta.full());
+	ASSERT_EQ(meta.low_mark(), 11);
+	ASSERT_EQ(meta.acked(), 1);
+	for (int i = 0; i < meta_size; ++i) {
+		ASSERT_EQ(meta[i].size, chunk_sizes[i]);
+	}
+	ASSERT_TRUE(meta[10].state == ioremap::grape::chunk_entry::STATE_ACKED);
+}
+
+TEST_F(ChunkMeta, CheckJournalReplayIsIdempotent) {
+	for (int i = 0; i < meta_size; ++i) {
+		meta.push(chunk_sizes[i]);
+	}
+	for (int i = 0; i < meta_size / 2; ++i) {
+		meta.pop();
+		meta.ack(i, ioremap::grape::chunk_entry::STATE_ACKED);
+	}
+
+	// replaying what meta already has changes nothing
+	for (int i = 0; i < meta_size; ++i) {
+		ASSERT_TRUE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::PUSH, i, chunk_sizes[i]}));
+	}
+	for (int i = 0; i < meta_size / 2; ++i) {
+		ASSERT_TRUE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::ACK, i, 0}));
+	}
+
+	ASSERT_TRUE(meta.full());
+	ASSERT_EQ(meta.low_mark() * 2, meta.high_mark());
+	ASSERT_EQ(meta.acked(), meta.low_mark());
+}
+
+TEST_F(ChunkMeta, CheckAckRange) {
+	for (int i = 0; i < meta_size; ++i) {
+		meta.push(chunk_sizes[i]);
+	}
+	for (int i = 0; i < meta_size / 2; ++i) {
+		meta.pop();
+	}
+	meta.ack(5, ioremap::grape::chunk_entry::STATE_ACKED);
+
+	// already acked entry is not counted
+	ASSERT_EQ(meta.ack_range(0, 9), 9);
+	ASSERT_EQ(meta.ack_range(0, 9), 0);
+	ASSERT_EQ(meta.acked(), 10);
+	for (int i = 0; i < 10; ++i) {
+		ASSERT_TRUE(meta[i].state == ioremap::grape::chunk_entry::STATE_ACKED);
+	}
+	ASSERT_FALSE(meta[10].state == ioremap::grape::chunk_entry::STATE_ACKED);
+
+	ASSERT_EQ(meta.ack_range(10, meta_size / 2 - 1), meta_size / 2 - 10);
+	ASSERT_EQ(meta.acked(), meta.low_mark());
+}
+
+TEST_F(ChunkMeta, CheckDeliveryAttempts) {
+	for (int i = 0; i < 10; ++i) {
+		meta.push(chunk_sizes[i]);
+		meta.pop();
+	}
+
+	ASSERT_EQ(meta.attempts(3), 1);
+	ASSERT_EQ(meta.redelivered(3), 2);
+	ASSERT_EQ(meta.redelivered(3), 3);
+	ASSERT_EQ(meta.redelivered(4), 2);
+	ASSERT_EQ(meta.attempts(3), 3);
+
+	// acked entries are not counted anymore
+	meta.ack(3, ioremap::grape::chunk_entry::STATE_ACKED);
+	meta.ack_range(4, 5);
+	ASSERT_EQ(meta.attempts(3), 1);
+	ASSERT_EQ(meta.attempts(4), 1);
+}
+
+TEST_F(ChunkMeta, CheckDeliveryAttemptsRoundTrip) {
+	for (int i = 0; i < 10; ++i) {
+		meta.push(chunk_sizes[i]);
+		meta.pop();
+	}
+	meta.redelivered(3);
+	meta.redelivered(3);
+	meta.redelivered(5);
+
+	std::string blob = meta.data();
+	ASSERT_TRUE(((ioremap::grape::chunk_disk_header *)blob.data())->version == ioremap::grape::chunk_disk_header::VERSION_ATTEMPTS);
+
+	ioremap::grape::chunk_meta copy(1);
+	copy.assign((char *)blob.data(), blob.size());
+	ASSERT_EQ(copy.high_mark(), meta.high_mark());
+	ASSERT_EQ(copy.attempts(3), 3);
+	ASSERT_EQ(copy.attempts(5), 2);
+	ASSERT_EQ(copy.attempts(4), 1);
+
+	// journaled attempts never lower what meta already has
+	ASSERT_TRUE(copy.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::ATTEMPT, 3, 2}));
+	ASSERT_TRUE(copy.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::ATTEMPT, 4, 3}));
+	ASSERT_EQ(copy.attempts(3), 3);
+	ASSERT_EQ(copy.attempts(4), 4);
+	ASSERT_FALSE(copy.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::ATTEMPT, 10, 2}));
+}
+
+TEST_F(ChunkMeta, CheckExpiresRoundTrip) {
+	for (int i = 0; i < meta_size / 2; ++i) {
+		meta.push(chunk_sizes[i]);
+	}
+	meta.push(chunk_sizes[meta_size / 2], 1000);
+	ASSERT_TRUE(meta.expiring());
+	ASSERT_EQ(meta.expire(0), 0u);
+	ASSERT_EQ(meta.expire(meta_size / 2), 1000u);
+	meta.seal();
+
+	std::string blob = meta.data();
+	ASSERT_TRUE(((ioremap::grape::chunk_disk_header *)blob.data())->version == ioremap::grape::chunk_disk_header::VERSION_EXPIRES);
+
+	ioremap::grape::chunk_meta copy(1);
+	copy.assign((char *)blob.data(), blob.size());
+	ASSERT_EQ(copy.high_mark(), meta.high_mark());
+	for (int i = 0; i < copy.high_mark(); ++i) {
+		ASSERT_EQ(copy[i].size, meta[i].size);
+		ASSERT_EQ(copy.expire(i), meta.expire(i));
+	}
+
+	// entries which never expire keep the chunk alive
+	ASSERT_TRUE(copy.expired(meta_size / 2, 1000));
+	ASSERT_FALSE(copy.expired(meta_size / 2, 999));
+	ASSERT_FALSE(copy.expired(2000));
+}
+
+TEST_F(ChunkMeta, CheckExpiredChunkAfterReplay) {
+	const int pushed = 10;
+	for (int i = 0; i < pushed; ++i) {
+		meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::PUSH, i, chunk_sizes[i]});
+		meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::EXPIRE, i, 100 + i});
+	}
+	ASSERT_FALSE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::EXPIRE, pushed, 100}));
+
+	// chunk which could get more entries is never expired as a whole
+	ASSERT_FALSE(meta.expired(1000));
+	meta.seal();
+	ASSERT_FALSE(meta.expired(100 + pushed - 2));
+	ASSERT_TRUE(meta.expired(100 + pushed - 1));
+}
+
+TEST_F(ChunkMeta, CheckExpiredChunkWithMixedTtl) {
+	for (int i = 0; i < 10; ++i) {
+		meta.push(chunk_sizes[i], i == 3 ? 500 : 100 + i);
+	}
+	meta.seal();
+
+	// entry with a longer ttl keeps the chunk alive after the newest one expires
+	ASSERT_FALSE(meta.expired(109));
+	ASSERT_FALSE(meta.expired(499));
+	ASSERT_TRUE(meta.expired(500));
+
+	// expiry times replayed later are taken into account
+	ASSERT_TRUE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::EXPIRE, 5, 0}));
+	ASSERT_FALSE(meta.expired(1000));
+}
+
+TEST_F(ChunkMeta, CheckAckRangeThrowsOnNotPoppedEntries) {
+	for (int i = 0; i < meta_size; ++i) {
+		meta.push(chunk_sizes[i]);
+	}
+	for (int i = 0; i < 10; ++i) {
+		meta.pop();
+	}
+
+	ASSERT_THROW(meta.ack_range(0, 10), ioremap::elliptics::error);
+	ASSERT_THROW(meta.ack_range(5, 4), ioremap::elliptics::error);
+	ASSERT_THROW(meta.ack_range(-1, 4), ioremap::elliptics::error);
+	ASSERT_EQ(meta.acked(), 0);
+}
+
+TEST_F(ChunkMeta, CheckJournalReplayOfAckRange) {
+	for (int i = 0; i < meta_size; ++i) {
+		ASSERT_TRUE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::PUSH, i, chunk_sizes[i]}));
+	}
+	ASSERT_TRUE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::ACK_RANGE, 10, 19}));
+	ASSERT_TRUE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::ACK_RANGE, 15, 24}));
+
+	ASSERT_EQ(meta.low_mark(), 25);
+	ASSERT_EQ(meta.acked(), 15);
+	ASSERT_FALSE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::ACK_RANGE, 5, 4}));
+	ASSERT_FALSE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::ACK_RANGE, 0, meta_size}));
+}
+
+TEST_F(ChunkMeta, CheckJournalReplayRejectsBadRecords) {
+	ASSERT_FALSE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::PUSH, meta_size, 1}));
+	ASSERT_FALSE(meta.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::ACK, 0, 0}));
+	ASSERT_FALSE(meta.replay(ioremap::grape::chunk_journal_record{0, 0, 0}));
+	ASSERT_EQ(meta.high_mark(), 0);
+}
+
+TEST_F(ChunkMeta, CheckSealedMetaIsFull) {
+	for (int i = 0; i < meta_size / 2; ++i) {
+		meta.push(chunk_sizes[i]);
+	}
+	meta.seal();
+
+	ASSERT_TRUE(meta.full());
+	ASSERT_THROW(meta.push(1), ioremap::elliptics::error);
+}
+
+TEST_F(ChunkMeta, CheckByteOffsetAfterAssignAndReplay) {
+	for (int i = 0; i < meta_size / 2; ++i) {
+		meta.push(chunk_sizes[i]);
+	}
+
+	std::string blob = meta.data();
+	ioremap::grape::chunk_meta copy(meta_size);
+	copy.assign((char *)blob.data(), blob.size());
+	for (int i = meta_size - 1; i >= meta_size / 2; --i) {
+		copy.replay(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::PUSH, i, chunk_sizes[i]});
+	}
+
+	uint64_t offset = 0;
+	for (int i = 0; i < meta_size; ++i) {
+		ASSERT_EQ(offset, copy.byte_offset(i));
+		offset += chunk_sizes[i];
+	}
+	ASSERT_EQ(offset, copy.byte_offset(meta_size));
+}
+
+TEST_F(ChunkMeta, CheckOutOfOrderWritesArePublishedInPushOrder) {
+	ioremap::elliptics::file_logger log("/dev/stderr", 0);
+	ioremap::elliptics::node node(log);
+	ioremap::elliptics::session session(node);
+
+	ioremap::grape::chunk chunk(session, "test-queue", 0, meta_size, 1000);
+	chunk.set_loaded();
+
+	std::vector<std::string> entries = {"aaa", "bbbbb", "c", "dddd"};
+	// first batch has two entries
+	std::vector<uint64_t> ids(3);
+	chunk.push(ioremap::elliptics::data_pointer::copy((entries[0] + entries[1]).data(), 8), std::vector<int>{3, 5},
+			ioremap::grape::chunk::write_handler(), &ids[0]);
+	chunk.push(ioremap::elliptics::data_pointer::copy(entries[2].data(), 1), std::vector<int>{1},
+			ioremap::grape::chunk::write_handler(), &ids[1]);
+	chunk.push(ioremap::elliptics::data_pointer::copy(entries[3].data(), 4), std::vector<int>{4},
+			ioremap::grape::chunk::write_handler(), &ids[2]);
+
+	// last write lands first, nothing is published before the earlier ones
+	chunk.push_complete(ids[2], ioremap::elliptics::error_info());
+	ASSERT_EQ(chunk.meta().high_mark(), 0);
+
+	chunk.push_complete(ids[0], ioremap::elliptics::error_info());
+	ASSERT_EQ(chunk.meta().high_mark(), 2);
+
+	chunk.push_complete(ids[1], ioremap::elliptics::error_info());
+	ASSERT_EQ(chunk.meta().high_mark(), 4);
+	ASSERT_FALSE(chunk.pushing());
+
+	uint64_t offset = 0;
+	for (int i = 0; i < 4; ++i) {
+		ASSERT_EQ(chunk.meta().byte_offset(i), offset);
+		offset += entries[i].size();
+
+		ioremap::elliptics::data_pointer d;
+		ASSERT_TRUE(chunk.read(i, &d));
+		ASSERT_EQ(d.to_string(), entries[i]);
+	}
+}
+
+TEST_F(ChunkMeta, CheckFailedWriteIsRolledBackWithLaterOnes) {
+	ioremap::elliptics::file_logger log("/dev/stderr", 0);
+	ioremap::elliptics::node node(log);
+	ioremap::elliptics::session session(node);
+
+	ioremap::grape::chunk chunk(session, "test-queue", 0, meta_size, 1000);
+	chunk.set_loaded();
+
+	std::vector<uint64_t> ids(3);
+	for (int i = 0; i < 3; ++i) {
+		chunk.push(ioremap::elliptics::data_pointer::copy("abc", 3), std::vector<int>{3},
+				ioremap::grape::chunk::write_handler(), &ids[i]);
+	}
+
+	chunk.push_complete(ids[1], ioremap::elliptics::error_info(-EIO, "write failed"));
+	ASSERT_TRUE(chunk.rolling_back());
+	ASSERT_THROW(chunk.push(ioremap::elliptics::data_pointer::copy("x", 1), std::vector<int>{1},
+				ioremap::grape::chunk::write_handler(), &ids[0]), ioremap::elliptics::error);
+
+	// write before the failed one is published, the one after it is still in flight
+	chunk.push_complete(ids[0], ioremap::elliptics::error_info());
+	ASSERT_EQ(chunk.meta().high_mark(), 1);
+	ASSERT_TRUE(chunk.rolling_back());
+
+	chunk.push_complete(ids[2], ioremap::elliptics::error_info());
+	ASSERT_FALSE(chunk.rolling_back());
+	ASSERT_FALSE(chunk.pushing());
+	ASSERT_EQ(chunk.meta().high_mark(), 1);
+	ASSERT_FALSE(chunk.meta().full());
+	ASSERT_EQ(chunk.capacity(), meta_size - 1);
+
+	// pushing goes on right after the published entries
+	chunk.push(ioremap::elliptics::data_pointer::copy("defg", 4), std::vector<int>{4},
+			ioremap::grape::chunk::write_handler(), &ids[1]);
+	chunk.push_complete(ids[1], ioremap::elliptics::error_info());
+	ASSERT_EQ(chunk.meta().high_mark(), 2);
+	ASSERT_EQ(chunk.meta().byte_offset(1), 3u);
+
+	ioremap::elliptics::data_pointer d;
+	ASSERT_TRUE(chunk.read(1, &d));
+	ASSERT_EQ(d.to_string(), "defg");
+}
+
+TEST_F(ChunkMeta, CheckClosedChunkIsSealedOnRollback) {
+	ioremap::elliptics::file_logger log("/dev/stderr", 0);
+	ioremap::elliptics::node node(log);
+	ioremap::elliptics::session session(node);
+
+	ioremap::grape::chunk chunk(session, "test-queue", 0, 4, 1000);
+	chunk.set_loaded();
+
+	std::vector<uint64_t> ids(2);
+	for (int i = 0; i < 2; ++i) {
+		chunk.push(ioremap::elliptics::data_pointer::copy("abcd", 4), std::vector<int>{2, 2},
+				ioremap::grape::chunk::write_handler(), &ids[i]);
+	}
+	ASSERT_TRUE(chunk.full());
+
+	// queue moves on once reservations fill, before writes land
+	chunk.close();
+	ASSERT_FALSE(chunk.meta().full());
+
+	chunk.push_complete(ids[0], ioremap::elliptics::error_info());
+	chunk.push_complete(ids[1], ioremap::elliptics::error_info(-EIO, "write failed"));
+	ASSERT_FALSE(chunk.pushing());
+	ASSERT_EQ(chunk.meta().high_mark(), 2);
+	ASSERT_TRUE(chunk.meta().full());
+	ASSERT_TRUE(chunk.full());
+}
+
+TEST_F(ChunkMeta, CheckClosedLoadedChunkIsSealed) {
+	ioremap::elliptics::file_logger log("/dev/stderr", 0);
+	ioremap::elliptics::node node(log);
+	ioremap::elliptics::session session(node);
+
+	ioremap::grape::chunk chunk(session, "test-queue", 0, 4, 1000);
+	chunk.set_loaded();
+
+	uint64_t id;
+	chunk.push(ioremap::elliptics::data_pointer::copy("abc", 3), std::vector<int>{3},
+			ioremap::grape::chunk::write_handler(), &id);
+	chunk.push_complete(id, ioremap::elliptics::error_info());
+	ASSERT_FALSE(chunk.meta().full());
+
+	// room lost with a crash is sealed off right away
+	chunk.close();
+	ASSERT_EQ(chunk.meta().high_mark(), 1);
+	ASSERT_TRUE(chunk.meta().full());
+	ASSERT_EQ(chunk.capacity(), 0);
+}
+
+TEST_F(ChunkMeta, CheckTornJournalRecordIsDropped) {
+	ioremap::elliptics::file_logger log("/dev/stderr", 0);
+	ioremap::elliptics::node node(log);
+	ioremap::elliptics::session session(node);
+
+	std::vector<ioremap::grape::chunk_journal_record> records;
+	for (int i = 0; i < 3; ++i) {
+		records.push_back(ioremap::grape::chunk_journal_record{ioremap::grape::chunk_journal_record::PUSH, i, chunk_sizes[i]});
+	}
+	size_t size = records.size() * sizeof(records[0]);
+	auto torn = ioremap::elliptics::data_pointer::copy(records.data(), size - sizeof(records[0]) / 2);
+	ioremap::elliptics::error_info no_meta(-ENOENT, "meta not found");
+
+	ioremap::grape::chunk chunk(session, "test-queue", 0, meta_size, 1000);
+	ASSERT_TRUE(chunk.load_complete(ioremap::elliptics::data_pointer(), no_meta, torn, ioremap::elliptics::error_info()));
+	ASSERT_EQ(chunk.meta().high_mark(), 2);
+
+	// journal shorter than a record has nothing to replay
+	ioremap::grape::chunk short_journal(session, "test-queue", 1, meta_size, 1000);
+	ASSERT_FALSE(short_journal.load_complete(ioremap::elliptics::data_pointer(), no_meta,
+				ioremap::elliptics::data_pointer::copy(records.data(), 5), ioremap::elliptics::error_info()));
+	ASSERT_EQ(short_journal.meta().high_mark(), 0);
+}
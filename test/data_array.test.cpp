@@ -63,3 +63,42 @@ TEST(DataArray, EnumerateConstArray) {
     std::vector<data_array::entry> entries(b.begin(), b.end());
     EXPECT_EQ(std::string(entries[0].data, entries[0].size), "entry");
 }
+
+TEST(EntryRange, FromIds) {
+    std::vector<entry_id> ids = {{1, 0}, {1, 1}, {1, 2}, {1, 5}, {2, 6}, {2, 7}, {3, 0}};
+
+    auto ranges = entry_range::from_ids(ids);
+    ASSERT_EQ(ranges.size(), 4u);
+
+    EXPECT_EQ(ranges[0].chunk, 1);
+    EXPECT_EQ(ranges[0].from, 0);
+    EXPECT_EQ(ranges[0].to, 2);
+    EXPECT_EQ(ranges[1].from, 5);
+    EXPECT_EQ(ranges[1].to, 5);
+    EXPECT_EQ(ranges[2].chunk, 2);
+    EXPECT_EQ(ranges[2].from, 6);
+    EXPECT_EQ(ranges[2].to, 7);
+    EXPECT_EQ(ranges[3].chunk, 3);
+
+    EXPECT_TRUE(entry_range::from_ids(std::vector<entry_id>()).empty());
+}
+
+TEST(DataArray, Attempts) {
+    data_array a;
+    a.append("first", entry_id{1, 0});
+    EXPECT_EQ(a.attempts(0), 1);
+
+    a.append("second", 6, entry_id{1, 1}, 3);
+    a.append("third", entry_id{1, 2});
+
+    data_array b;
+    b.append("fourth", entry_id{2, 0});
+    b.extend(a);
+    b.append("fifth", 5, entry_id{2, 1}, 2);
+
+    std::vector<int> attempts;
+    for (auto entry : b) {
+        attempts.push_back(entry.attempts);
+    }
+    EXPECT_EQ(attempts, std::vector<int>({1, 1, 3, 1, 2}));
+}
@@ -0,0 +1,87 @@
+#include <vector>
+#include <utility>
+
+#include <gtest/gtest.h>
+
+#include "src/queue/timer_wheel.hpp"
+
+typedef ioremap::grape::timer_wheel<int> wheel_type;
+typedef std::vector<std::pair<int, uint64_t>> fired_type;
+
+static fired_type advance(wheel_type &wheel, uint64_t now) {
+	fired_type fired;
+	wheel.advance(now, [&fired] (int item, uint64_t deadline) {
+		fired.push_back(std::make_pair(item, deadline));
+	});
+	return fired;
+}
+
+TEST(TimerWheel, CheckFiresOnlyExpired) {
+	wheel_type wheel(10);
+	wheel.add(1000, 1100, 1);
+	wheel.add(1000, 1200, 2);
+	ASSERT_EQ(wheel.size(), 2u);
+
+	ASSERT_TRUE(advance(wheel, 1050).empty());
+
+	fired_type fired = advance(wheel, 1150);
+	ASSERT_EQ(fired.size(), 1u);
+	ASSERT_EQ(fired[0].first, 1);
+	ASSERT_EQ(fired[0].second, 1100u);
+
+	fired = advance(wheel, 1200);
+	ASSERT_EQ(fired.size(), 1u);
+	ASSERT_EQ(fired[0].first, 2);
+	ASSERT_TRUE(wheel.empty());
+}
+
+TEST(TimerWheel, CheckFiresInDeadlineOrderAcrossLevels) {
+	wheel_type wheel(1);
+
+	// deadlines spread over all levels of the wheel
+	std::vector<uint64_t> deadlines = {5, 300, 70000, 20000000, 255, 256, 65536, 100};
+	for (size_t i = 0; i < deadlines.size(); ++i) {
+		wheel.add(0, deadlines[i], i);
+	}
+
+	uint64_t last = 0;
+	size_t count = 0;
+	uint64_t now = 0;
+	while (!wheel.empty()) {
+		now = wheel.next_time();
+		ASSERT_GT(now, 0u);
+
+		for (const auto &f : advance(wheel, now)) {
+			// timer never fires early nor late
+			ASSERT_EQ(f.second, now);
+			ASSERT_GE(f.second, last);
+			last = f.second;
+			++count;
+		}
+	}
+	ASSERT_EQ(count, deadlines.size());
+	ASSERT_EQ(now, 20000000u);
+}
+
+TEST(TimerWheel, CheckOverdueFiresOnNextTick) {
+	wheel_type wheel(10);
+	advance(wheel, 1000);
+
+	wheel.add(1000, 500, 1);
+	ASSERT_EQ(wheel.next_time(), 1010u);
+
+	fired_type fired = advance(wheel, 1010);
+	ASSERT_EQ(fired.size(), 1u);
+	ASSERT_EQ(fired[0].second, 500u);
+}
+
+TEST(TimerWheel, CheckClear) {
+	wheel_type wheel(10);
+	wheel.add(0, 100, 1);
+	wheel.add(0, 1000000, 2);
+	wheel.clear();
+
+	ASSERT_TRUE(wheel.empty());
+	ASSERT_EQ(wheel.next_time(), 0u);
+	ASSERT_TRUE(advance(wheel, 2000000).empty());
+}